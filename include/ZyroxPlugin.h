@@ -11,6 +11,42 @@ class ZyroxPlugin : public PassInfoMixin<ZyroxPlugin>
     PreservedAnalyses run(Module &m, ModuleAnalysisManager &mam);
 
     static bool isRequired() { return true; }
+
+    // everything that runs before (plans, string encryption, ...) and after
+    // (metadata, shuffling, tables) the function passes.
+    static void Prepare(Module &m, ModuleAnalysisManager &mam);
+
+    static void Finalize(Module &m);
+};
+
+// Prepare and Finalize as separate passes, so single zyrox passes
+// (zyrox-cff, zyrox-mba, ...) can be scheduled in between from opt:
+// -passes='zyrox-prepare,zyrox-cff,zyrox-finalize'
+class ZyroxPreparePass : public PassInfoMixin<ZyroxPreparePass>
+{
+  public:
+    PreservedAnalyses run(Module &m, ModuleAnalysisManager &mam);
+
+    static bool isRequired() { return true; }
+};
+
+class ZyroxFinalizePass : public PassInfoMixin<ZyroxFinalizePass>
+{
+  public:
+    PreservedAnalyses run(Module &m, ModuleAnalysisManager &mam);
+
+    static bool isRequired() { return true; }
+};
+
+// marks functions with a plan (annotations, config, call graph propagation)
+// noinline at pipeline start, only scheduled when zyrox itself runs after the
+// inliner (see -zyrox-insertion-point).
+class ZyroxPinPlannedPass : public PassInfoMixin<ZyroxPinPlannedPass>
+{
+  public:
+    PreservedAnalyses run(Module &m, ModuleAnalysisManager &mam);
+
+    static bool isRequired() { return true; }
 };
 
-#endif
\ No newline at end of file
+#endif
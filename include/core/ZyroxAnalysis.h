@@ -0,0 +1,44 @@
+#ifndef ZYROX_ANALYSIS_H
+#define ZYROX_ANALYSIS_H
+
+#include <core/ZyroxPassOptions.h>
+#include <llvm/Analysis/BlockFrequencyInfo.h>
+#include <llvm/Analysis/BranchProbabilityInfo.h>
+#include <llvm/Analysis/LoopInfo.h>
+#include <llvm/Analysis/ProfileSummaryInfo.h>
+#include <llvm/IR/Dominators.h>
+#include <llvm/IR/PassManager.h>
+
+using namespace llvm;
+
+// analyses shared by all passes, results come from (and are cached in) the
+// FunctionAnalysisManager of the pipeline zyrox is running in.
+// whoever changes the CFG is responsible for calling Invalidate.
+class ZyroxAnalysis
+{
+    static FunctionAnalysisManager *fam;
+    static ProfileSummaryInfo *psi;
+
+  public:
+    static void SetManager(FunctionAnalysisManager *manager);
+
+    // module level, null when running without a module analysis manager
+    static void SetProfileSummary(ProfileSummaryInfo *summary);
+
+    static ProfileSummaryInfo *GetProfileSummary();
+
+    static DominatorTree &GetDomTree(Function &f);
+
+    static LoopInfo &GetLoopInfo(Function &f);
+
+    static BlockFrequencyInfo &GetBlockFrequency(Function &f);
+
+    static BranchProbabilityInfo &GetBranchProbability(Function &f);
+
+    static void Invalidate(Function &f, const PreservedAnalyses &pa);
+
+    // what is still valid after `pass` transformed a function
+    static PreservedAnalyses PreservedBy(const ZyroxFunctionPass &pass);
+};
+
+#endif // ZYROX_ANALYSIS_H
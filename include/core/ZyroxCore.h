@@ -1,6 +1,7 @@
 #ifndef ZYROX_CORE_H
 #define ZYROX_CORE_H
 
+#include <core/ZyroxPassOptions.h>
 #include <llvm/IR/GlobalVariable.h>
 
 using namespace llvm;
@@ -10,6 +11,10 @@ class Zyrox
   public:
     static void RunOnFunction(Function &f);
 
+    // runs only the entries of f's plan that belong to `pass`, returns false
+    // if there were none. used by the standalone pipeline passes.
+    static bool RunPassOnFunction(Function &f, const ZyroxFunctionPass &pass);
+
 }; // namespace Zyrox
 
 #endif // ZYROX_CORE_H
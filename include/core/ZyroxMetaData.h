@@ -39,6 +39,12 @@ class ZyroxPassesMetadata
     static void MarkObfuscated(Function &f);
 
     static bool IsObfuscated(Function &f);
+
+    // plan entries of this pass code already ran on f, from zyrox or a
+    // standalone zyrox-<code> pass
+    static void MarkPassRan(Function &f, StringRef code);
+
+    static bool HasPassRan(Function &f, StringRef code);
 };
 
 #endif // ZYROX_METADATA_H
@@ -0,0 +1,26 @@
+#ifndef ZYROX_MODULE_OPTIONS_H
+#define ZYROX_MODULE_OPTIONS_H
+
+#include <llvm/ADT/StringRef.h>
+#include <map>
+#include <string>
+
+using namespace llvm;
+
+// module wide options, set from the js config through z.SetOption
+class ZyroxModuleOptions
+{
+    static std::map<std::string, int> options;
+    static std::map<std::string, std::string> string_options;
+
+  public:
+    static void Set(StringRef key, int value);
+
+    static int Get(StringRef key, int default_value = 0);
+
+    static void SetString(StringRef key, StringRef value);
+
+    static std::string GetString(StringRef key, StringRef default_value = "");
+};
+
+#endif // ZYROX_MODULE_OPTIONS_H
@@ -0,0 +1,42 @@
+#ifndef ZYROX_PASS_ADAPTOR_H
+#define ZYROX_PASS_ADAPTOR_H
+
+#include <core/ZyroxAnalysis.h>
+#include <core/ZyroxCore.h>
+#include <llvm/IR/PassManager.h>
+
+using namespace llvm;
+
+// exposes a single zyrox pass (e.g. ControlFlowFlattening) as a new-pm
+// module pass, it runs the entries of every function plan that belong to T.
+// a module pass since passes also create functions and globals (resolvers,
+// siphash clones, tables) and edit shared ones like ___siphash.
+template <typename T>
+class ZyroxModulePassAdaptor : public PassInfoMixin<ZyroxModulePassAdaptor<T>>
+{
+  public:
+    PreservedAnalyses run(Module &m, ModuleAnalysisManager &mam)
+    {
+        FunctionAnalysisManager &fam =
+            mam.getResult<FunctionAnalysisManagerModuleProxy>(m).getManager();
+        ZyroxAnalysis::SetManager(&fam);
+        // computed if nothing cached it, hot/cold tagging needs it
+        ZyroxAnalysis::SetProfileSummary(
+            &mam.getResult<ProfileSummaryAnalysis>(m));
+
+        bool changed = false;
+        for (Function &f : m)
+            changed |= Zyrox::RunPassOnFunction(f, T::pass_info);
+
+        ZyroxAnalysis::SetManager(nullptr);
+        ZyroxAnalysis::SetProfileSummary(nullptr);
+
+        // functions were added and the analyses of the touched ones are
+        // already invalidated one by one
+        return changed ? PreservedAnalyses::none() : PreservedAnalyses::all();
+    }
+
+    static bool isRequired() { return true; }
+};
+
+#endif // ZYROX_PASS_ADAPTOR_H
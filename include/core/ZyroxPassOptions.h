@@ -19,6 +19,15 @@ class ZyroxAnnotationArgs
     int NextOrDefault(int default_value);
 };
 
+// ir properties a pass expects to hold before it runs, the core establishes
+// them lazily (only if a scheduled pass requires them) and once per function.
+enum ZyroxIRProperty : unsigned
+{
+    ZyroxIRNone = 0,
+    ZyroxIRNoSwitches = 1 << 0,
+    ZyroxIRNoPHINodes = 1 << 1,
+};
+
 typedef struct
 {
     std::function<void(Function &f, ZyroxPassOptions *options)> RunOnFunction;
@@ -26,6 +35,8 @@ typedef struct
         RegisterFromAnnotation;
     const char *Name;
     const char *CodeName;
+    unsigned Requires; // ZyroxIRProperty mask
+    bool PreservesCFG;
 } ZyroxFunctionPass;
 
 extern std::vector<ZyroxFunctionPass> zyrox_passes;
@@ -0,0 +1,21 @@
+#ifndef ZYROX_POLICY_H
+#define ZYROX_POLICY_H
+
+#include <llvm/Analysis/CallGraph.h>
+#include <llvm/IR/Module.h>
+
+using namespace llvm;
+
+class ZyroxPolicy
+{
+  public:
+    // copies the plan of every function that already has one (annotation or
+    // js config) to its callees, up to CallGraph.PropagationDepth calls deep.
+    static void PropagateFromRoots(Module &m);
+
+  private:
+    static bool ShouldPropagateTo(CallGraphNode *callee_node,
+                                  int min_leaf_size, int max_call_sites);
+};
+
+#endif // ZYROX_POLICY_H
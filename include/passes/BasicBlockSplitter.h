@@ -20,6 +20,8 @@ class BasicBlockSplitter
         .RegisterFromAnnotation = RegisterFromAnnotation,
         .Name = "BasicBlockSplitter",
         .CodeName = "bbs",
+        .Requires = ZyroxIRNone,
+        .PreservesCFG = false,
     };
 
   private:
@@ -9,6 +9,27 @@ using namespace llvm;
 class ControlFlowFlattening
 {
   public:
+    enum Dispatcher
+    {
+        // one check per block, reaching block k costs k compares
+        DispatcherLinear = 0,
+        // balanced tree over the sorted states, O(log n) compares
+        DispatcherBinarySearch = 1,
+        // dense states behind a key, a single switch lowered to a jump table
+        DispatcherJumpTable = 2,
+    };
+
+    enum SipHashVariant
+    {
+        // calls to the linked ___siphash (2-4 rounds), cloned and inlined
+        // by CloneSipHashChance
+        SipHashShared = 0,
+        // 2-4 rounds emitted inline with the keys folded in
+        SipHashInline = 1,
+        // 1-2 rounds emitted inline with the keys folded in
+        SipHashReduced = 2,
+    };
+
     struct TransformationOptions
     {
         int UseFunctionResolverChance;
@@ -17,17 +38,47 @@ class ControlFlowFlattening
         int UseGlobalVariableOpaquesChance;
         int UseSipHashedStateChance;
         int CloneSipHashChance;
+        int SipHashTier;
+        int DispatcherKind;
+        // 32-bit states on 64-bit targets, no movabs for every state
+        bool Use32BitStates;
+        // one siphash key set/opaque transform per dispatcher, the state is
+        // transformed once per transition instead of once per check
+        bool ShareDispatcherKeys;
+        // conditional branches blend the two states instead of going
+        // through true/false trampolines
+        bool BranchlessTransitions;
+        // predecessors are split over this many dispatcher copies, as long
+        // as the copies stay under the instructions cap
+        int DispatcherCopies;
+        int DispatcherCopiesMaxInstructions;
+        // a dispatcher per outer loop body, loop headers, latches and
+        // innermost loops are not flattened so loop passes still see them
+        bool PreserveLoops;
+        // straight-line chains keep their edges, one dispatch per this many
+        // blocks. 0 or 1 flattens every block
+        int MaxChainLength;
+        // this percent of the most frequent edges stay direct branches
+        int KeepHotEdgesPercent;
+        // the dispatcher of a cold function rarely runs, its resolvers go to
+        // .text.unlikely
+        bool IsColdFunction;
     };
 
     static void RunOnFunction(Function &f, ZyroxPassOptions *options);
 
     static void RegisterFromAnnotation(Function &f, ZyroxAnnotationArgs *args);
 
+    // forgets the siphash functions and budget of the finished module
+    static void Reset();
+
     inline static ZyroxFunctionPass pass_info = {
         .RunOnFunction = RunOnFunction,
         .RegisterFromAnnotation = RegisterFromAnnotation,
         .Name = "ControlFlowFlattening",
         .CodeName = "cff",
+        .Requires = ZyroxIRNoSwitches | ZyroxIRNoPHINodes,
+        .PreservesCFG = false,
     };
 
   private:
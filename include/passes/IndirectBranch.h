@@ -18,6 +18,8 @@ class IndirectBranch
         .RegisterFromAnnotation = RegisterFromAnnotation,
         .Name = "IndirectBranch",
         .CodeName = "ibr",
+        .Requires = ZyroxIRNoSwitches,
+        .PreservesCFG = false,
     };
 
   private:
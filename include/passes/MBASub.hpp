@@ -31,6 +31,8 @@ class MBASub
         .RegisterFromAnnotation = RegisterFromAnnotation,
         .Name = "MixedBooleanArithmetic",
         .CodeName = "mba",
+        .Requires = ZyroxIRNone,
+        .PreservesCFG = true,
     };
 
   private:
@@ -18,6 +18,8 @@ class SimpleIndirectBranch
         .RegisterFromAnnotation = RegisterFromAnnotation,
         .Name = "SimpleIndirectBranch",
         .CodeName = "sibr",
+        .Requires = ZyroxIRNoSwitches,
+        .PreservesCFG = false,
     };
 
   private:
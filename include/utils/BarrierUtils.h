@@ -0,0 +1,28 @@
+#ifndef BARRIER_UTILS_H
+#define BARRIER_UTILS_H
+
+#include <llvm/IR/IRBuilder.h>
+
+using namespace llvm;
+
+// how generated code keeps protected values (dispatcher states, table
+// contents, decrypted offsets) away from the optimizer.
+// Barrier.Mode 0: every generated memory access is volatile.
+// Barrier.Mode 1: protected values go through an empty inline asm, scratch
+// accesses are plain loads and stores the backend can keep in registers.
+class BarrierUtils
+{
+  public:
+    // whether scratch loads and stores (counters, temporaries, the dispatcher
+    // state slot) have to be volatile
+    static bool VolatileScratch();
+
+    // v (an integer or pointer that fits a register) as a value the optimizer
+    // can't see through, returned as is in volatile mode.
+    static Value *Opaque(IRBuilderBase &builder, Value *v);
+
+    // the value passed to an Opaque barrier, or v itself
+    static Value *StripOpaque(Value *v);
+};
+
+#endif // BARRIER_UTILS_H
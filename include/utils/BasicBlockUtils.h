@@ -2,6 +2,8 @@
 #define BASIC_BLOCK_UTIL_H
 
 #include <any>
+#include <llvm/IR/Instruction.h>
+#include <llvm/IR/Instructions.h>
 #include <llvm/IR/Value.h>
 
 using namespace llvm;
@@ -16,6 +18,31 @@ class BasicBlockUtils
     static std::optional<std::any> GetMetaData(BasicBlock *bb, std::string key);
 
     static void RemoveMetaData(BasicBlock *bb);
+
+    // tags are kept as metadata on every instruction of the block, so they
+    // survive block splits (both halves keep tagged instructions).
+    static void Tag(BasicBlock *bb, StringRef tag);
+
+    static void Tag(Instruction *i, StringRef tag);
+
+    static bool HasTag(BasicBlock *bb, StringRef tag);
+
+    static bool HasTag(Instruction *i, StringRef tag);
+
+    // copies every tag set on `from` to `to`, used when a pass replaces a
+    // tagged instruction (e.g. a terminator).
+    static void InheritTags(Instruction *from, Instruction *to);
+
+    static void StripTags(Function &f);
+
+    // true if the block is inside a region marked with
+    // __zyrox_region_begin/__zyrox_region_end, or if the function has no
+    // marked regions at all.
+    static bool IsInRegion(BasicBlock *bb);
+
+    // the tail call bb ends with (`call; [bitcast;] ret`), nullptr if none.
+    // nothing may be placed between the call and the ret.
+    static CallInst *GetTailCall(BasicBlock *bb);
 };
 
 #endif // BASIC_BLOCK_UTIL_H
@@ -16,9 +16,23 @@ class FunctionUtils
 
     static void DemoteRegToStack(Function &f);
 
+    // re-promotes the stack slots DemotePHIToStack/DemoteRegToStack created
+    // and folds the trivial blocks cff leaves behind, blocks zyrox did not
+    // create are left alone.
+    static void Cleanup(Function &f);
+
     static void FlattenSwitches(Function &f);
 
+    // `tail call; br %exit` where %exit only returns the call result gets its
+    // own ret, so the call stays a tail call whatever happens to %exit (phi
+    // demotion, flattening). returns true if the cfg changed.
+    static bool DuplicateTailReturns(Function &f);
+
     static void EnsureAllocasInEntryBlocks(Function &f);
+
+    // turns __zyrox_region_begin/__zyrox_region_end call pairs into tagged
+    // blocks and removes the marker calls, returns false if f has none.
+    static bool MarkRegions(Function &f);
 };
 
 #endif // FUNCTION_UTIL_H
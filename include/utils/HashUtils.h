@@ -7,8 +7,11 @@ class HashUtils
 {
 
   public:
+    // SipHash-c-d of a single 8 bytes block, c/d default to the reference
+    // 2-4 (the linked ___siphash)
     static uint64_t SipHash(uint64_t in, uint64_t k0, uint64_t k1, uint64_t v0,
-                            uint64_t v1, uint64_t v2, uint64_t v3);
+                            uint64_t v1, uint64_t v2, uint64_t v3,
+                            int c_rounds = 2, int d_rounds = 4);
 
     static const char *SipHashLlvmIR();
 };
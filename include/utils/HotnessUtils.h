@@ -0,0 +1,45 @@
+#ifndef HOTNESS_UTILS_H
+#define HOTNESS_UTILS_H
+
+#include <llvm/IR/Module.h>
+#include <llvm/IR/PassManager.h>
+
+using namespace llvm;
+
+class HotnessUtils
+{
+  public:
+    // applies Profile.File (a .profdata) to the module if the module doesn't
+    // carry a profile already (e.g. !prof from the compile step in lto).
+    static void LoadProfile(Module &m, ModuleAnalysisManager &mam);
+
+    // tags hot and cold blocks from the profile, and hot loops from the
+    // static estimation (Hotness.Threshold). must run before passes change
+    // the cfg, does nothing if f was already tagged.
+    static void TagBlocks(Function &f);
+
+    static bool IsHot(BasicBlock *bb);
+
+    static bool IsCold(BasicBlock *bb);
+
+    // body of an innermost hot loop
+    static bool IsInnerLoop(BasicBlock *bb);
+
+    // body of a small innermost hot loop, kept out of the cff dispatcher
+    static bool IsTightLoop(BasicBlock *bb);
+
+    // arithmetic feeding a hot loop header phi (induction, accumulators)
+    static bool IsLoopCarried(Instruction *i);
+
+    // terminator of a hot loop latch
+    static bool IsBackEdge(Instruction *i);
+
+    static bool IsHotFunction(Function &f);
+
+    static bool IsColdFunction(Function &f);
+
+    // cold attribute and .text.unlikely placement for generated functions
+    static void MarkCold(Function &f);
+};
+
+#endif // HOTNESS_UTILS_H
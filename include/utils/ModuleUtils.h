@@ -13,8 +13,28 @@ class ModuleUtils
 
     static void ShuffleFunctions(Module &m);
 
+    // functions grouped with their helpers: a function that is only called
+    // from one other function joins the cluster of that caller. the root of
+    // a cluster is its first element.
+    static std::vector<std::vector<Function *>> FunctionClusters(Module &m);
+
+    // shuffles functions within and between clusters (hot clusters first),
+    // globals are grouped by the cluster using them and follow that order.
+    static void ShuffleClustered(Module &m);
+
+    // lld --symbol-ordering-file: every cluster containing an obfuscated
+    // function (root first, then its helpers), hottest clusters first.
+    static void WriteSymbolOrder(Module &m, const char *path);
+
     static void ExpandCustomAnnotations(Module &m);
 
+    // marks functions with a plan noinline, so they still exist (and are not
+    // copied unobfuscated into their callers) when zyrox runs after inlining.
+    // the plans are dropped, Prepare builds them again at the insertion point
+    static void PinPlannedFunctions(Module &m);
+
+    static void ExpandRegionMarkers(Module &m);
+
     static std::unique_ptr<Module> LoadFromIR(LLVMContext &ctx, const char *ir);
 
     static void LinkModules(Module &dst, std::unique_ptr<Module> src);
@@ -0,0 +1,31 @@
+#ifndef SCRATCH_SLOTS_H
+#define SCRATCH_SLOTS_H
+
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Instructions.h>
+
+using namespace llvm;
+
+// stack slots of a function shared by every pass, so iterations and passes
+// don't each grow the frame.
+class ScratchSlots
+{
+  public:
+    // one slot per (function, type, name), for code that always stores before
+    // it loads and never interleaves with another user of the same name
+    // (switch conditions, decryption counters). no lifetime markers.
+    static AllocaInst *Shared(Function &f, Type *ty, StringRef name);
+
+    // a slot that is only live between Acquire and Release, both emit
+    // lifetime markers at the builder position. a released slot is handed out
+    // again by the next Acquire of the same type, the region in between must
+    // run (dynamically) before the next region that uses it starts.
+    static AllocaInst *Acquire(IRBuilderBase &builder, Type *ty,
+                               StringRef name);
+
+    static void Release(IRBuilderBase &builder, AllocaInst *slot);
+
+    static void Reset();
+};
+
+#endif // SCRATCH_SLOTS_H
@@ -28,6 +28,146 @@ declare interface FunctionPassOptions {
     "ControlFlowFlattening.UseGlobalVariableOpaquesChance"?: number;
     "ControlFlowFlattening.UseSipHashedStateChance"?: number;
     "ControlFlowFlattening.CloneSipHashChance"?: number;
+    /**
+     * @default 0
+     * @description 0: linear chain of checks, 1: binary search over the states, 2: jump table over dense states.
+     */
+    "ControlFlowFlattening.DispatcherKind"?: number;
+    /**
+     * @default 0
+     * @description 1 to use 32-bit states on 64-bit targets.
+     */
+    "ControlFlowFlattening.Use32BitStates"?: number;
+    /**
+     * @default 0
+     * @description 1 to hash/transform the state once per dispatch with a single key set instead of once per check.
+     */
+    "ControlFlowFlattening.ShareDispatcherKeys"?: number;
+    /**
+     * @default 0
+     * @description 1 to compute the next state of a conditional branch without a branch or trampoline blocks.
+     */
+    "ControlFlowFlattening.BranchlessTransitions"?: number;
+    /**
+     * @default 0
+     * @description split the transitions over this many copies of the dispatcher.
+     */
+    "ControlFlowFlattening.DispatcherCopies"?: number;
+    /**
+     * @default 2000
+     * @description instructions budget for the extra dispatcher copies.
+     */
+    "ControlFlowFlattening.DispatcherCopiesMaxInstructions"?: number;
+    /**
+     * @default 0
+     * @description 1 to give every outer loop its own dispatcher, keep loop headers and latches unflattened and leave
+     * innermost loops untouched.
+     */
+    "ControlFlowFlattening.PreserveLoops"?: number;
+    /**
+     * @default 0
+     * @description straight-line chains of blocks cost one dispatch per this many blocks, 0 or 1 flattens every block.
+     */
+    "ControlFlowFlattening.MaxChainLength"?: number;
+    /**
+     * @default 0
+     * @description percent of the most frequent edges kept as direct branches.
+     */
+    "ControlFlowFlattening.KeepHotEdgesPercent"?: number;
+    /**
+     * @default 0
+     * @description 0: calls to the shared siphash (cloned by CloneSipHashChance), 1: siphash inlined with the keys
+     * folded in, 2: same with 1 compression and 2 finalization rounds instead of 2 and 4.
+     */
+    "ControlFlowFlattening.SipHashTier"?: number;
+}
+
+declare interface ModuleOptions {
+    /**
+     * @default 0
+     * @description copy the plan of every annotated/configured function to its callees, up to this many calls deep.
+     * 0 disables propagation.
+     */
+    "CallGraph.PropagationDepth"?: number;
+    /**
+     * @default 16
+     * @description leaf callees with fewer instructions than this are not worth obfuscating and are skipped
+     */
+    "CallGraph.MinLeafInstructions"?: number;
+    /**
+     * @default 8
+     * @description callees with more call sites than this are treated as shared utilities and are skipped
+     */
+    "CallGraph.MaxCallSites"?: number;
+    /**
+     * @description path of a .profdata (llvm-profdata merge output) to read block and function counts from.
+     * ignored if the module already carries a profile (e.g. `!prof` from the compile step in lto builds).
+     */
+    "Profile.File"?: string;
+    /**
+     * @default 990000
+     * @description blocks in this percentile of the profile (parts per million) are hot and get cheaper treatment:
+     * no IndirectBranch, no MixedBooleanArithmetic and no BasicBlockSplitter.
+     */
+    "Profile.HotCutoff"?: number;
+    /**
+     * @default 999999
+     * @description blocks whose count is below this percentile (parts per million) are cold
+     */
+    "Profile.ColdCutoff"?: number;
+    /**
+     * @default 0
+     * @description static hotness estimation, works without a profile. a loop is hot if its header runs at least this
+     * many times per call (estimated by llvm's block frequency), every loop of a `hot` function is hot and none of a
+     * `cold` one. in hot loops: back edges stay direct branches, loop carried arithmetic skips
+     * MixedBooleanArithmetic, innermost bodies are not split and small innermost loops are not flattened.
+     * 0 disables it.
+     */
+    "Hotness.Threshold"?: number;
+    /**
+     * @default 0
+     * @description how passes lay out blocks after transforming a function.
+     * 0: every block (but the entry) at a random position.
+     * 1: likely fallthrough chains stay contiguous (by branch probabilities, or the profile), chains and cold blocks
+     * are shuffled.
+     */
+    "BlockLayout.Mode"?: number;
+    /**
+     * @default 0
+     * @description how functions and globals are ordered in the final module.
+     * 0: both shuffled over the whole module.
+     * 1: functions are clustered with the helpers only they call (resolvers, siphash clones, internal helpers), hot
+     * clusters are grouped first; globals used by a single cluster follow it. shuffling happens within and between
+     * clusters.
+     */
+    "SymbolLayout.Mode"?: number;
+    /**
+     * @default 0
+     * @description cleanup after all passes ran on a function.
+     * 0: none.
+     * 1: values zyrox spilled to the stack are promoted back to registers and trivial flattening blocks are folded
+     * (true/false state blocks become a select, empty forwarding blocks are removed). only zyrox blocks are touched.
+     */
+    "Cleanup.Mode"?: number;
+    /**
+     * @default 0
+     * @description how generated code is kept from being optimized away.
+     * 0: every generated load and store is volatile.
+     * 1: only protected values (dispatcher states, table addresses, decrypted offsets, decryption seeds) go through
+     * an empty inline asm barrier, counters and temporaries are plain loads and stores that can live in registers.
+     */
+    "Barrier.Mode"?: number;
+    /**
+     * @default 32
+     * @description most siphash clones made by CloneSipHashChance in the module, existing clones are reused past it.
+     */
+    "SipHash.MaxClones"?: number;
+    /**
+     * @default 50000
+     * @description IR instructions of siphash (clones and inlined tiers) the module can inline, past it every hash is
+     * a plain call.
+     */
+    "SipHash.MaxInlinedInstructions"?: number;
 }
 
 declare class z {
@@ -44,6 +184,25 @@ declare class z {
 
     static AddMetaData(MetaData: string): void;
 
+    static SetOption<K extends keyof ModuleOptions>(Name: K, Value: ModuleOptions[K]): void;
+
+}
+
+declare interface StringInfo {
+    Value: string;
+    /**
+     * @description size of the string global in bytes, including the terminator
+     */
+    Length: number;
+    /**
+     * @description number of instructions referencing the string
+     */
+    UseCount: number;
+    /**
+     * @description false if the string is referenced outside of a function (e.g. another global),
+     * such strings can't be encrypted on stack
+     */
+    AllUsesInFunctions: boolean;
 }
 
 declare interface ZyroxPlugin {
@@ -52,6 +211,13 @@ declare interface ZyroxPlugin {
 
     OnString(Str: string): number;
 
+    /**
+     * @description batched variant of OnString, called once with every candidate string.
+     * returns one mode (z.None, z.Stack or z.Global) per string, in the same order.
+     * when defined, OnString is not called.
+     */
+    OnStrings?(Strings: StringInfo[]): number[];
+
     Init(): void;
 
 }
@@ -1,24 +1,37 @@
 #include <ZyroxPlugin.h>
 #include <atomic>
+#include <core/ZyroxAnalysis.h>
 #include <core/ZyroxCore.h>
+#include <core/ZyroxPassAdaptor.h>
+#include <core/ZyroxPolicy.h>
+#include <cstdlib>
+#include <llvm/ADT/StringSwitch.h>
 #include <llvm/IR/DebugInfo.h>
 #include <llvm/IR/Function.h>
 #include <llvm/IR/PassManager.h>
 #include <llvm/Passes/PassBuilder.h>
 #include <llvm/Passes/PassPlugin.h>
+#include <llvm/Support/CommandLine.h>
+#include <passes/BasicBlockSplitter.h>
+#include <passes/ControlFlowFlattening.h>
+#include <passes/IndirectBranch.h>
+#include <passes/MBASub.hpp>
+#include <passes/SimpleIndirectBranch.h>
 #include <passes/StringEncryption.h>
 #include <quickjs/QuickConfig.h>
 #include <quickjs/QuickRt.h>
 #include <utils/CryptoUtils.h>
 #include <utils/HashUtils.h>
+#include <utils/HotnessUtils.h>
 #include <utils/Logger.h>
 #include <utils/ModuleUtils.h>
+#include <utils/ScratchSlots.h>
 
 using namespace llvm;
 
 std::atomic state{false};
 
-PreservedAnalyses ZyroxPlugin::run(Module &m, ModuleAnalysisManager &)
+void ZyroxPlugin::Prepare(Module &m, ModuleAnalysisManager &mam)
 {
     QuickRt::InitZyroxRuntime();
 
@@ -29,11 +42,42 @@ PreservedAnalyses ZyroxPlugin::run(Module &m, ModuleAnalysisManager &)
 
     StripDebugInfo(m);
 
+    // the profile is matched against each function's cfg hash, it has to be
+    // loaded before string decryption loops and region markers change them
+    HotnessUtils::LoadProfile(m, mam);
+    ZyroxAnalysis::SetProfileSummary(&mam.getResult<ProfileSummaryAnalysis>(m));
+
     StringEncryption::ObfuscateGlobalArrayStrings(m);
 
     ModuleUtils::ExpandCustomAnnotations(m);
+    ModuleUtils::ExpandRegionMarkers(m);
     QuickConfig::RegisterPasses(m);
 
+    ZyroxPolicy::PropagateFromRoots(m);
+}
+
+void ZyroxPlugin::Finalize(Module &m)
+{
+    ModuleUtils::Finalize(m);
+    ModuleUtils::WriteSymbolOrder(m, "zyrox_symbol_order.txt");
+    ZyroxAnalysis::SetProfileSummary(nullptr);
+    ScratchSlots::Reset();
+    ControlFlowFlattening::Reset();
+
+    QuickRt::DestroyInstance();
+    CryptoUtils::FinalizeZyroxTables();
+
+    Logger::Info("Zyrox: finish.");
+}
+
+PreservedAnalyses ZyroxPlugin::run(Module &m, ModuleAnalysisManager &mam)
+{
+    Prepare(m, mam);
+
+    FunctionAnalysisManager &fam =
+        mam.getResult<FunctionAnalysisManagerModuleProxy>(m).getManager();
+    ZyroxAnalysis::SetManager(&fam);
+
     auto &func_list = m.getFunctionList();
     auto it = func_list.begin();
     while (it != func_list.end())
@@ -42,45 +86,189 @@ PreservedAnalyses ZyroxPlugin::run(Module &m, ModuleAnalysisManager &)
         ++it;
     }
 
-    ModuleUtils::Finalize(m);
+    ZyroxAnalysis::SetManager(nullptr);
 
-    QuickRt::DestroyInstance();
-    CryptoUtils::FinalizeZyroxTables();
+    Finalize(m);
 
-    Logger::Info("Zyrox: finish.");
+    return PreservedAnalyses::none();
+}
+
+PreservedAnalyses ZyroxPreparePass::run(Module &m, ModuleAnalysisManager &mam)
+{
+    ZyroxPlugin::Prepare(m, mam);
+
+    // the zyrox-<code> passes after it read the summary Prepare computed
+    PreservedAnalyses pa = PreservedAnalyses::none();
+    pa.preserve<ProfileSummaryAnalysis>();
+    return pa;
+}
+
+PreservedAnalyses ZyroxFinalizePass::run(Module &m, ModuleAnalysisManager &)
+{
+    ZyroxPlugin::Finalize(m);
+    return PreservedAnalyses::none();
+}
+
+PreservedAnalyses ZyroxPinPlannedPass::run(Module &m,
+                                           ModuleAnalysisManager &mam)
+{
+    // same plans as Prepare. the js runtime stays up so the config's Init only
+    // runs once per module, Profile.File is loaded here already so hot leaves
+    // aren't pinned (Prepare then keeps it)
+    QuickRt::InitZyroxRuntime();
+    HotnessUtils::LoadProfile(m, mam);
+    ZyroxAnalysis::SetProfileSummary(
+        &mam.getResult<ProfileSummaryAnalysis>(m));
 
+    ModuleUtils::ExpandCustomAnnotations(m);
+    QuickConfig::RegisterPasses(m);
+    ZyroxPolicy::PropagateFromRoots(m);
+    ModuleUtils::PinPlannedFunctions(m);
+
+    ZyroxAnalysis::SetProfileSummary(nullptr);
     return PreservedAnalyses::none();
 }
 
+bool ParseZyroxPass(StringRef name, ModulePassManager &mpm)
+{
+#define ZYROX_PASS(pass_class)                                                 \
+    if (name == std::string("zyrox-") + pass_class::pass_info.CodeName)        \
+    {                                                                          \
+        mpm.addPass(ZyroxModulePassAdaptor<pass_class>());                     \
+        return true;                                                           \
+    }
+
+    ZYROX_PASS(ControlFlowFlattening)
+    ZYROX_PASS(BasicBlockSplitter)
+    ZYROX_PASS(IndirectBranch)
+    ZYROX_PASS(MBASub)
+    ZYROX_PASS(SimpleIndirectBranch)
+#undef ZYROX_PASS
+
+    return false;
+}
+
+enum class ZyroxInsertionPoint
+{
+    Early,
+    PostInline,
+    OptimizerLast,
+    FullLtoLast,
+};
+
+cl::opt<ZyroxInsertionPoint> insertion_point(
+    "zyrox-insertion-point",
+    cl::desc("where zyrox runs in the pipeline, can also be set with the "
+             "ZYROX_INSERTION_POINT environment variable"),
+    cl::init(ZyroxInsertionPoint::Early),
+    cl::values(
+        clEnumValN(ZyroxInsertionPoint::Early, "early",
+                   "before inlining (early simplification / full lto early)"),
+        clEnumValN(ZyroxInsertionPoint::PostInline, "post-inline",
+                   "after the inliner and function simplification"),
+        clEnumValN(ZyroxInsertionPoint::OptimizerLast, "optimizer-last",
+                   "after vectorization, at the end of the optimizer"),
+        clEnumValN(ZyroxInsertionPoint::FullLtoLast, "full-lto-last",
+                   "at the end of the full lto pipeline only")));
+
+// lld loads pass plugins after parsing -mllvm options, so the option is not
+// always reachable from the command line.
+ZyroxInsertionPoint GetInsertionPoint()
+{
+    if (insertion_point.getNumOccurrences() > 0)
+        return insertion_point;
+
+    const char *env = std::getenv("ZYROX_INSERTION_POINT");
+    if (!env)
+        return insertion_point;
+
+    std::optional<ZyroxInsertionPoint> point =
+        StringSwitch<std::optional<ZyroxInsertionPoint>>(env)
+            .Case("early", ZyroxInsertionPoint::Early)
+            .Case("post-inline", ZyroxInsertionPoint::PostInline)
+            .Case("optimizer-last", ZyroxInsertionPoint::OptimizerLast)
+            .Case("full-lto-last", ZyroxInsertionPoint::FullLtoLast)
+            .Default(std::nullopt);
+
+    if (!point.has_value())
+    {
+        Logger::Warn("unknown ZYROX_INSERTION_POINT {}, using early", env);
+        return ZyroxInsertionPoint::Early;
+    }
+
+    return point.value();
+}
+
+void AddZyroxPass(ModulePassManager &mpm, OptimizationLevel)
+{
+    if (state.load())
+        return;
+
+    state.store(true);
+
+    mpm.addPass(ZyroxPlugin());
+}
+
 PassPluginLibraryInfo GetZyroxPluginPluginInfo()
 {
     return {LLVM_PLUGIN_API_VERSION, "ZyroxPlugin", LLVM_VERSION_STRING,
             [](PassBuilder &pb)
             {
-                // clang comptime pass
-                pb.registerPipelineEarlySimplificationEPCallback(
-                    [&](ModulePassManager &mpm, OptimizationLevel)
-                    {
-                        if (state.load())
-                            return true;
+                ZyroxInsertionPoint point = GetInsertionPoint();
 
-                        state.store(true);
+                if (point != ZyroxInsertionPoint::Early)
+                {
+                    // keep planned functions out of line until zyrox runs.
+                    // the full lto pipeline never calls the pipeline start
+                    // callbacks, its early ep is still before the inliner
+                    pb.registerPipelineStartEPCallback(
+                        [](ModulePassManager &mpm, OptimizationLevel)
+                        { mpm.addPass(ZyroxPinPlannedPass()); });
+                    pb.registerFullLinkTimeOptimizationEarlyEPCallback(
+                        [](ModulePassManager &mpm, OptimizationLevel)
+                        { mpm.addPass(ZyroxPinPlannedPass()); });
+                }
 
-                        mpm.addPass(ZyroxPlugin());
+                switch (point)
+                {
+                case ZyroxInsertionPoint::Early:
+                    // clang comptime pass
+                    pb.registerPipelineEarlySimplificationEPCallback(
+                        AddZyroxPass);
+                    // lto pass
+                    pb.registerFullLinkTimeOptimizationEarlyEPCallback(
+                        AddZyroxPass);
+                    break;
+                case ZyroxInsertionPoint::PostInline:
+                    pb.registerOptimizerEarlyEPCallback(AddZyroxPass);
+                    // full lto has no ep between inlining and the end
+                    pb.registerFullLinkTimeOptimizationLastEPCallback(
+                        AddZyroxPass);
+                    break;
+                case ZyroxInsertionPoint::OptimizerLast:
+                    pb.registerOptimizerLastEPCallback(AddZyroxPass);
+                    pb.registerFullLinkTimeOptimizationLastEPCallback(
+                        AddZyroxPass);
+                    break;
+                case ZyroxInsertionPoint::FullLtoLast:
+                    pb.registerFullLinkTimeOptimizationLastEPCallback(
+                        AddZyroxPass);
+                    break;
+                }
 
-                        return true;
-                    });
-                // lto pass
-                pb.registerFullLinkTimeOptimizationEarlyEPCallback(
-                    [&](ModulePassManager &mpm, OptimizationLevel)
+                // opt -passes=...
+                pb.registerPipelineParsingCallback(
+                    [](StringRef name, ModulePassManager &mpm,
+                       ArrayRef<PassBuilder::PipelineElement>)
                     {
-                        if (state.load())
-                            return true;
-
-                        state.store(true);
-
-                        mpm.addPass(ZyroxPlugin());
-
+                        if (name == "zyrox")
+                            mpm.addPass(ZyroxPlugin());
+                        else if (name == "zyrox-prepare")
+                            mpm.addPass(ZyroxPreparePass());
+                        else if (name == "zyrox-finalize")
+                            mpm.addPass(ZyroxFinalizePass());
+                        else
+                            return ParseZyroxPass(name, mpm);
                         return true;
                     });
             }};
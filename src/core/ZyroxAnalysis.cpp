@@ -0,0 +1,75 @@
+#include <core/ZyroxAnalysis.h>
+#include <llvm/Demangle/Demangle.h>
+#include <llvm/IR/Function.h>
+#include <utils/Logger.h>
+
+FunctionAnalysisManager *ZyroxAnalysis::fam = nullptr;
+ProfileSummaryInfo *ZyroxAnalysis::psi = nullptr;
+
+void ZyroxAnalysis::SetManager(FunctionAnalysisManager *manager)
+{
+    fam = manager;
+}
+
+void ZyroxAnalysis::SetProfileSummary(ProfileSummaryInfo *summary)
+{
+    psi = summary;
+}
+
+ProfileSummaryInfo *ZyroxAnalysis::GetProfileSummary() { return psi; }
+
+// a hard error in release builds too, a null manager would only crash later
+FunctionAnalysisManager &RequireManager(FunctionAnalysisManager *manager,
+                                        Function &f, const char *analysis)
+{
+    if (!manager)
+    {
+        Logger::Error("{} of {} requested outside of a pass manager", analysis,
+                      demangle(f.getName()));
+    }
+    return *manager;
+}
+
+DominatorTree &ZyroxAnalysis::GetDomTree(Function &f)
+{
+    FunctionAnalysisManager &manager =
+        RequireManager(fam, f, "dominator tree");
+    return manager.getResult<DominatorTreeAnalysis>(f);
+}
+
+LoopInfo &ZyroxAnalysis::GetLoopInfo(Function &f)
+{
+    FunctionAnalysisManager &manager =
+        RequireManager(fam, f, "loop info");
+    return manager.getResult<LoopAnalysis>(f);
+}
+
+BlockFrequencyInfo &ZyroxAnalysis::GetBlockFrequency(Function &f)
+{
+    FunctionAnalysisManager &manager =
+        RequireManager(fam, f, "block frequency");
+    return manager.getResult<BlockFrequencyAnalysis>(f);
+}
+
+BranchProbabilityInfo &ZyroxAnalysis::GetBranchProbability(Function &f)
+{
+    FunctionAnalysisManager &manager =
+        RequireManager(fam, f, "branch probability");
+    return manager.getResult<BranchProbabilityAnalysis>(f);
+}
+
+void ZyroxAnalysis::Invalidate(Function &f, const PreservedAnalyses &pa)
+{
+    if (fam)
+        fam->invalidate(f, pa);
+}
+
+PreservedAnalyses ZyroxAnalysis::PreservedBy(const ZyroxFunctionPass &pass)
+{
+    if (!pass.PreservesCFG)
+        return PreservedAnalyses::none();
+
+    PreservedAnalyses pa;
+    pa.preserveSet<CFGAnalyses>();
+    return pa;
+}
@@ -1,22 +1,42 @@
+#include <core/ZyroxAnalysis.h>
 #include <core/ZyroxCore.h>
 #include <core/ZyroxMetaData.h>
+#include <core/ZyroxModuleOptions.h>
 #include <llvm/Support/raw_ostream.h>
 #include <llvm/IR/Function.h>
 #include <llvm/IR/Verifier.h>
 #include <utils/FunctionUtils.h>
+#include <utils/HotnessUtils.h>
 #include <utils/Logger.h>
 
 void DebugRun(std::string &function_name, ZyroxPassOptions *pass_options);
 
+void EstablishIRProperties(Function &f, unsigned required,
+                           unsigned &established);
+
+void RunPlanEntry(Function &f, std::string &function_name,
+                  ZyroxPassOptions *pass_options, unsigned &established);
+
 void Zyrox::RunOnFunction(Function &f)
 {
     if (f.isDeclaration() || !f.hasMetadata("zyrox"))
         return;
 
-    if (ZyroxPassesMetadata::IsObfuscated(f))
+    // a standalone zyrox-<code> pass may already have run part of the plan
+    std::vector<ZyroxPassOptions> plan;
+    for (ZyroxPassOptions pass_options : ZyroxPassesMetadata::PassesOf(f))
+    {
+        if (!ZyroxPassesMetadata::HasPassRan(f,
+                                             pass_options.GetPass().CodeName))
+            plan.push_back(pass_options);
+    }
+
+    if (plan.empty())
         return;
 
     ZyroxPassesMetadata::MarkObfuscated(f);
+    for (ZyroxPassOptions pass_options : plan)
+        ZyroxPassesMetadata::MarkPassRan(f, pass_options.GetPass().CodeName);
 
     if (FunctionUtils::HasCXXExceptions(f))
     {
@@ -28,19 +48,82 @@ void Zyrox::RunOnFunction(Function &f)
     Logger::Info("Running passes on {}", demangle(f.getName()));
     std::string function_name = demangle(f.getName());
 
-    FunctionUtils::FlattenSwitches(f);
-    FunctionUtils::DemotePHIToStack(f);
+    // tail calls get their own ret before passes start moving blocks around
+    FunctionUtils::DuplicateTailReturns(f);
+    // that, string encryption and region markers all edit f before any pass
+    // runs, drop whatever the pipeline cached for f before them.
+    ZyroxAnalysis::Invalidate(f, PreservedAnalyses::none());
+    HotnessUtils::TagBlocks(f);
+
+    unsigned established = ZyroxIRNone;
+
+    for (ZyroxPassOptions pass_options : plan)
+    {
+        RunPlanEntry(f, function_name, &pass_options, established);
+    }
+
+    if (ZyroxModuleOptions::Get("Cleanup.Mode") == 1)
+        FunctionUtils::Cleanup(f);
+}
 
+bool Zyrox::RunPassOnFunction(Function &f, const ZyroxFunctionPass &pass)
+{
+    if (f.isDeclaration() || !f.hasMetadata("zyrox"))
+        return false;
+
+    // a repeated zyrox-<code>, or zyrox before it, already ran these entries
+    if (ZyroxPassesMetadata::HasPassRan(f, pass.CodeName))
+        return false;
+
+    std::vector<ZyroxPassOptions> entries;
     for (ZyroxPassOptions pass_options : ZyroxPassesMetadata::PassesOf(f))
     {
-        DebugRun(function_name, &pass_options);
-        pass_options.RunPass(f);
-        if (verifyFunction(f, &errs()))
-        {
-            f.print(errs());
-            Logger::Error("Function verification failed after running {} on {}",
-                          pass_options.GetPass().Name, function_name);
-        }
+        if (StringRef(pass_options.GetPass().CodeName) == pass.CodeName)
+            entries.push_back(pass_options);
+    }
+
+    if (entries.empty())
+        return false;
+
+    ZyroxPassesMetadata::MarkObfuscated(f);
+    ZyroxPassesMetadata::MarkPassRan(f, pass.CodeName);
+
+    if (FunctionUtils::HasCXXExceptions(f))
+        return false;
+
+    std::string function_name = demangle(f.getName());
+    if (FunctionUtils::DuplicateTailReturns(f))
+        ZyroxAnalysis::Invalidate(f, PreservedAnalyses::none());
+    HotnessUtils::TagBlocks(f);
+
+    unsigned established = ZyroxIRNone;
+
+    for (ZyroxPassOptions pass_options : entries)
+    {
+        RunPlanEntry(f, function_name, &pass_options, established);
+    }
+
+    if (ZyroxModuleOptions::Get("Cleanup.Mode") == 1)
+        FunctionUtils::Cleanup(f);
+
+    return true;
+}
+
+void RunPlanEntry(Function &f, std::string &function_name,
+                  ZyroxPassOptions *pass_options, unsigned &established)
+{
+    ZyroxFunctionPass pass = pass_options->GetPass();
+
+    EstablishIRProperties(f, pass.Requires, established);
+    DebugRun(function_name, pass_options);
+    pass_options->RunPass(f);
+    ZyroxAnalysis::Invalidate(f, ZyroxAnalysis::PreservedBy(pass));
+
+    if (verifyFunction(f, &errs()))
+    {
+        f.print(errs());
+        Logger::Error("Function verification failed after running {} on {}",
+                      pass.Name, function_name);
     }
 }
 
@@ -50,4 +133,23 @@ void DebugRun(std::string &function_name, ZyroxPassOptions *pass_options)
     Logger::Info("Running {} on {} {} {}", pass_options->GetPass().Name,
                  function_name, iterations_count,
                  iterations_count > 1 ? "times" : "time");
-}
\ No newline at end of file
+}
+
+// passes don't reintroduce switches or phi nodes, so each canonicalization
+// runs at most once per function.
+void EstablishIRProperties(Function &f, unsigned required,
+                           unsigned &established)
+{
+    unsigned missing = required & ~established;
+
+    if (missing & ZyroxIRNoSwitches)
+    {
+        FunctionUtils::FlattenSwitches(f);
+        ZyroxAnalysis::Invalidate(f, PreservedAnalyses::none());
+    }
+
+    if (missing & ZyroxIRNoPHINodes)
+        FunctionUtils::DemotePHIToStack(f);
+
+    established |= missing;
+}
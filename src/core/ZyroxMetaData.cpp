@@ -178,4 +178,39 @@ bool ZyroxPassesMetadata::IsObfuscated(Function &f)
         return s->getString() == "obfuscated";
 
     return false;
-}
\ No newline at end of file
+}
+void ZyroxPassesMetadata::MarkPassRan(Function &f, StringRef code)
+{
+    if (HasPassRan(f, code))
+        return;
+
+    LLVMContext &ctx = f.getContext();
+    SmallVector<Metadata *, 8> codes;
+
+    if (MDNode *md = f.getMetadata("zyrox.ran"))
+    {
+        for (const auto &op : md->operands())
+            codes.push_back(op.get());
+    }
+
+    codes.push_back(MDString::get(ctx, code));
+    f.setMetadata("zyrox.ran", MDTuple::get(ctx, codes));
+}
+
+bool ZyroxPassesMetadata::HasPassRan(Function &f, StringRef code)
+{
+    MDNode *md = f.getMetadata("zyrox.ran");
+    if (!md)
+        return false;
+
+    for (const auto &op : md->operands())
+    {
+        if (auto *s = dyn_cast<MDString>(op.get()))
+        {
+            if (s->getString() == code)
+                return true;
+        }
+    }
+
+    return false;
+}
@@ -0,0 +1,31 @@
+#include <core/ZyroxModuleOptions.h>
+
+std::map<std::string, int> ZyroxModuleOptions::options;
+std::map<std::string, std::string> ZyroxModuleOptions::string_options;
+
+void ZyroxModuleOptions::Set(StringRef key, int value)
+{
+    options[key.str()] = value;
+}
+
+int ZyroxModuleOptions::Get(StringRef key, int default_value)
+{
+    auto it = options.find(key.str());
+    if (it == options.end())
+        return default_value;
+    return it->second;
+}
+
+void ZyroxModuleOptions::SetString(StringRef key, StringRef value)
+{
+    string_options[key.str()] = value.str();
+}
+
+std::string ZyroxModuleOptions::GetString(StringRef key,
+                                          StringRef default_value)
+{
+    auto it = string_options.find(key.str());
+    if (it == string_options.end())
+        return default_value.str();
+    return it->second;
+}
@@ -0,0 +1,101 @@
+#include <core/ZyroxModuleOptions.h>
+#include <core/ZyroxPolicy.h>
+#include <llvm/Analysis/CallGraph.h>
+#include <llvm/IR/InstrTypes.h>
+#include <set>
+#include <utils/HotnessUtils.h>
+#include <utils/Logger.h>
+
+int CountCallSites(Function &f)
+{
+    int count = 0;
+    for (User *user : f.users())
+    {
+        if (auto *call = dyn_cast<CallBase>(user))
+        {
+            if (call->getCalledFunction() == &f)
+                count++;
+        }
+    }
+    return count;
+}
+
+bool IsLeafFunction(CallGraphNode *node)
+{
+    for (auto &[_, callee_node] : *node)
+    {
+        Function *callee = callee_node->getFunction();
+        if (callee && !callee->isDeclaration())
+            return false;
+    }
+    return true;
+}
+
+void ZyroxPolicy::PropagateFromRoots(Module &m)
+{
+    int max_depth = ZyroxModuleOptions::Get("CallGraph.PropagationDepth");
+    if (max_depth <= 0)
+        return;
+
+    int min_leaf_size =
+        ZyroxModuleOptions::Get("CallGraph.MinLeafInstructions", 16);
+    int max_call_sites = ZyroxModuleOptions::Get("CallGraph.MaxCallSites", 8);
+
+    CallGraph call_graph(m);
+
+    std::vector<std::pair<Function *, int>> work_list;
+    std::set<Function *> visited;
+    for (Function &f : m)
+    {
+        if (!f.isDeclaration() && f.hasMetadata("zyrox"))
+        {
+            work_list.push_back({&f, 0});
+            visited.insert(&f);
+        }
+    }
+
+    // breadth first, so a callee reachable from two roots gets the plan of
+    // the closest one.
+    for (size_t i = 0; i < work_list.size(); i++)
+    {
+        auto [f, depth] = work_list[i];
+        if (depth >= max_depth)
+            continue;
+
+        MDNode *plan = f->getMetadata("zyrox");
+
+        for (auto &[_, callee_node] : *call_graph[f])
+        {
+            Function *callee = callee_node->getFunction();
+            if (!callee || callee->isDeclaration() || visited.contains(callee))
+                continue;
+
+            visited.insert(callee);
+
+            if (!ShouldPropagateTo(callee_node, min_leaf_size, max_call_sites))
+                continue;
+
+            Logger::Info("propagating plan of {} to {}", demangle(f->getName()),
+                         demangle(callee->getName()));
+            callee->setMetadata("zyrox", plan);
+            work_list.push_back({callee, depth + 1});
+        }
+    }
+}
+
+bool ZyroxPolicy::ShouldPropagateTo(CallGraphNode *callee_node,
+                                    int min_leaf_size, int max_call_sites)
+{
+    Function &callee = *callee_node->getFunction();
+
+    // shared, library style utilities
+    if (CountCallSites(callee) > max_call_sites)
+        return false;
+
+    if (!IsLeafFunction(callee_node))
+        return true;
+
+    // small or hot leaves cost more runtime than they hide
+    return callee.getInstructionCount() >= min_leaf_size &&
+           !HotnessUtils::IsHotFunction(callee);
+}
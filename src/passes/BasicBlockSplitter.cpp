@@ -2,7 +2,9 @@
 #include <llvm/Demangle/Demangle.h>
 #include <llvm/IR/Instructions.h>
 #include <llvm/Transforms/Utils/BasicBlockUtils.h>
+#include <utils/BasicBlockUtils.h>
 #include <utils/FunctionUtils.h>
+#include <utils/HotnessUtils.h>
 #include <utils/Logger.h>
 #include <utils/Random.h>
 
@@ -35,10 +37,6 @@ void BasicBlockSplitter::RunOnFunction(Function &f, ZyroxPassOptions *options)
     if (block_split_chance == 0)
         block_split_chance = 40;
 
-    FunctionUtils::FlattenSwitches(f);
-    FunctionUtils::DemotePHIToStack(f);
-    FunctionUtils::FlattenSwitches(f);
-
     for (int i = 0; i < iterations_count; i++)
     {
         ObfuscateFunction(f, min_block_size, max_block_size,
@@ -46,7 +44,6 @@ void BasicBlockSplitter::RunOnFunction(Function &f, ZyroxPassOptions *options)
     }
 
     FunctionUtils::ShuffleBlocks(f);
-    FunctionUtils::DemoteRegToStack(f);
 }
 
 void BasicBlockSplitter::RegisterFromAnnotation(Function &f,
@@ -70,6 +67,10 @@ void BasicBlockSplitter::ObfuscateFunction(Function &f, int min_block_size,
 
     for (BasicBlock &bb : f)
     {
+        if (!BasicBlockUtils::IsInRegion(&bb) || HotnessUtils::IsHot(&bb) ||
+            HotnessUtils::IsInnerLoop(&bb))
+            continue;
+
         if (size_t block_size = bb.size(); block_size >= min_block_size)
         {
             largest_block = &bb;
@@ -143,6 +144,15 @@ void SplitBlock(BasicBlock *bb, int block_max_size)
                 continue;
         }
 
+        // a tail call stays in the block of its ret
+        if (CallInst *tail_call = BasicBlockUtils::GetTailCall(current);
+            tail_call && tail_call->comesBefore(&*split_it))
+        {
+            split_it = tail_call->getIterator();
+            if (split_it == start_it)
+                continue;
+        }
+
         // Perform the split
         BasicBlock *new_block = current->splitBasicBlock(&*split_it);
 
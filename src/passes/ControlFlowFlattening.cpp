@@ -1,38 +1,134 @@
 #include <passes/ControlFlowFlattening.h>
+#include <cmath>
+#include <core/ZyroxAnalysis.h>
 #include <core/ZyroxMetaData.h>
+#include <core/ZyroxModuleOptions.h>
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/DenseSet.h>
+#include <llvm/ADT/SmallPtrSet.h>
 #include <llvm/Demangle/Demangle.h>
 #include <llvm/IR/DIBuilder.h>
 #include <llvm/IR/IRBuilder.h>
 #include <llvm/IR/InlineAsm.h>
+#include <llvm/IR/MDBuilder.h>
 #include <llvm/IR/Verifier.h>
 #include <llvm/TargetParser/Triple.h>
 #include <llvm/Transforms/Utils/Cloning.h>
 #include <llvm/Transforms/Utils/Local.h>
+#include <numeric>
 #include <quickjs/QuickConfig.h>
-#include <set>
+#include <unordered_map>
+#include <unordered_set>
+#include <utils/BarrierUtils.h>
 #include <utils/BasicBlockUtils.h>
 #include <utils/FunctionUtils.h>
 #include <utils/HashUtils.h>
+#include <utils/HotnessUtils.h>
 #include <utils/Logger.h>
 #include <utils/OpaqueTransformer.h>
 #include <utils/Random.h>
 
 Function *sip_hash_fn = nullptr;
+// ___siphash_1_2, what the reduced tier calls once nothing is inlined anymore
+Function *reduced_sip_hash_fn = nullptr;
+
+// module wide siphash budget. past SipHash.MaxClones the existing clones are
+// reused, past SipHash.MaxInlinedInstructions every hash is a plain call.
+// all of it belongs to the current module, see Reset
+std::vector<Function *> sip_hash_clones;
+int sip_hash_inlined_instructions = 0;
+
+typedef std::pair<BasicBlock *, BasicBlock *> Edge;
+
+// the states of one dispatcher. siphash keys are shared by a batch of about
+// sqrt(n) checks, the hashes of every state are computed once per key set
+// instead of once per check
+struct DispatcherStates
+{
+    std::unordered_set<uint64_t> values;
+    uint64_t siphash_keys[6];
+    std::unordered_map<uint64_t, int> siphash_counts;
+    size_t siphash_batch_left = 0;
+};
 
 Function *CreateFunctionForStateResolverCheck(
     Module *m, uint64_t target_state,
     ControlFlowFlattening::TransformationOptions *options,
-    std::set<uint64_t> &states, bool is_arm32);
+    DispatcherStates &states, bool is_32bit, bool transform_state);
 
 Value *GetTargetState(Module *m, IRBuilderBase &builder, uint64_t target_state,
                       ControlFlowFlattening::TransformationOptions *options,
-                      bool is_arm32);
+                      bool is_32bit);
 
 void MaybeTransformDispatcherState(
     Module *m, IRBuilderBase &builder, Value *&dispatcher_state,
     uint64_t &target_state,
     ControlFlowFlattening::TransformationOptions *options,
-    std::set<uint64_t> &states, bool is_arm32);
+    DispatcherStates &states, bool is_32bit);
+
+Value *CreateSipHashCall(Module *m, IRBuilderBase &builder, Value *state,
+                         const uint64_t keys[6],
+                         ControlFlowFlattening::TransformationOptions *options,
+                         bool is_32bit);
+
+Function *CloneSipHash();
+
+Function *GetReducedSipHash(Module *m);
+
+Value *EmitSipHash(IRBuilderBase &builder, Value *in, Value *const keys[6],
+                   int c_rounds, int d_rounds);
+
+std::pair<int, int>
+SipHashRounds(ControlFlowFlattening::TransformationOptions *options);
+
+void DrawSipHashKeys(DispatcherStates &states, uint64_t mask,
+                     ControlFlowFlattening::TransformationOptions *options);
+
+// what every dispatcher strategy needs to emit its blocks
+struct DispatcherContext
+{
+    Module *m;
+    AllocaInst *state;
+    BasicBlock *dispatch_bb;
+    BasicBlock *default_bb;
+    ControlFlowFlattening::TransformationOptions *options;
+    DispatcherStates *states;
+    bool is_32bit;
+    bool is_volatile;
+    // every block of the dispatcher, tagged once it's built
+    std::vector<BasicBlock *> blocks;
+};
+
+void BuildLinearDispatcher(DispatcherContext &dc,
+                           std::vector<BasicBlock *> &targets,
+                           DenseMap<BasicBlock *, uint64_t> &block_state_map);
+
+void BuildBinarySearchDispatcher(
+    DispatcherContext &dc, std::vector<BasicBlock *> &targets,
+    DenseMap<BasicBlock *, uint64_t> &block_state_map);
+
+void BuildJumpTableDispatcher(DispatcherContext &dc,
+                              std::vector<BasicBlock *> &targets,
+                              DenseMap<BasicBlock *, uint64_t> &block_state_map,
+                              uint64_t state_key);
+
+void ReplicateDispatcher(DispatcherContext &dc, int copies,
+                         int max_instructions);
+
+std::vector<std::vector<BasicBlock *>>
+GroupByLoop(Function &f, std::vector<BasicBlock *> &blocks);
+
+void CoarsenChains(std::vector<BasicBlock *> &blocks, int max_chain_length);
+
+DenseSet<Edge> SelectHotEdges(Function &f, std::vector<BasicBlock *> &blocks,
+                              int percent);
+
+void FlattenBlocks(Function &f,
+                   ControlFlowFlattening::TransformationOptions *options,
+                   AllocaInst *dispatcher_state,
+                   std::vector<BasicBlock *> &original_blocks,
+                   std::vector<BasicBlock *> &all_blocks,
+                   DenseSet<Edge> &kept_edges);
 
 void ControlFlowFlattening::RunOnFunction(Function &f,
                                           ZyroxPassOptions *options)
@@ -59,6 +155,24 @@ void ControlFlowFlattening::RunOnFunction(Function &f,
             options->Get("ControlFlowFlattening.UseSipHashedStateChance"),
         .CloneSipHashChance =
             options->Get("ControlFlowFlattening.CloneSipHashChance"),
+        .SipHashTier = options->Get("ControlFlowFlattening.SipHashTier"),
+        .DispatcherKind = options->Get("ControlFlowFlattening.DispatcherKind"),
+        .Use32BitStates =
+            options->Get("ControlFlowFlattening.Use32BitStates") == 1,
+        .ShareDispatcherKeys =
+            options->Get("ControlFlowFlattening.ShareDispatcherKeys") == 1,
+        .BranchlessTransitions =
+            options->Get("ControlFlowFlattening.BranchlessTransitions") == 1,
+        .DispatcherCopies =
+            options->Get("ControlFlowFlattening.DispatcherCopies"),
+        .DispatcherCopiesMaxInstructions = options->Get(
+            "ControlFlowFlattening.DispatcherCopiesMaxInstructions"),
+        .PreserveLoops =
+            options->Get("ControlFlowFlattening.PreserveLoops") == 1,
+        .MaxChainLength = options->Get("ControlFlowFlattening.MaxChainLength"),
+        .KeepHotEdgesPercent =
+            options->Get("ControlFlowFlattening.KeepHotEdgesPercent"),
+        .IsColdFunction = HotnessUtils::IsColdFunction(f),
     };
 
     if (sip_hash_fn == nullptr)
@@ -71,10 +185,32 @@ void ControlFlowFlattening::RunOnFunction(Function &f,
         }
         FunctionUtils::DemoteRegToStack(*sip_hash_fn);
         FunctionUtils::FlattenSwitches(*sip_hash_fn);
+        ZyroxAnalysis::Invalidate(*sip_hash_fn, PreservedAnalyses::none());
         FunctionUtils::DemotePHIToStack(*sip_hash_fn);
         sip_hash_fn->setLinkage(GlobalValue::InternalLinkage);
     }
 
+    if (t_options.DispatcherCopiesMaxInstructions == 0)
+        t_options.DispatcherCopiesMaxInstructions = 2000;
+
+    if (t_options.DispatcherKind < DispatcherLinear ||
+        t_options.DispatcherKind > DispatcherJumpTable)
+    {
+        Logger::Warn("ControlFlowFlattening: unknown dispatcher kind {} for "
+                     "{}, using the linear one.",
+                     t_options.DispatcherKind, demangle(f.getName()));
+        t_options.DispatcherKind = DispatcherLinear;
+    }
+
+    if (t_options.SipHashTier < SipHashShared ||
+        t_options.SipHashTier > SipHashReduced)
+    {
+        Logger::Warn("ControlFlowFlattening: unknown siphash tier {} for {}, "
+                     "using the shared one.",
+                     t_options.SipHashTier, demangle(f.getName()));
+        t_options.SipHashTier = SipHashShared;
+    }
+
     int iterations_count = options->Get("PassIterations");
 
     for (int i = 0; i < iterations_count; i++)
@@ -82,10 +218,20 @@ void ControlFlowFlattening::RunOnFunction(Function &f,
         ObfuscateFunction(f, &t_options);
     }
 
+    // iterations only move edges around, what they broke is demoted once
+    // against the final cfg (a single dominator tree for all of them).
+    // shuffling and moving allocas don't change dominance.
+    FunctionUtils::DemoteRegToStack(f);
     FunctionUtils::ShuffleBlocks(f);
     FunctionUtils::EnsureAllocasInEntryBlocks(f);
-    FunctionUtils::DemoteRegToStack(f);
-    FunctionUtils::DemotePHIToStack(f);
+}
+
+void ControlFlowFlattening::Reset()
+{
+    sip_hash_fn = nullptr;
+    reduced_sip_hash_fn = nullptr;
+    sip_hash_clones.clear();
+    sip_hash_inlined_instructions = 0;
 }
 
 void ControlFlowFlattening::RegisterFromAnnotation(Function &f,
@@ -98,15 +244,24 @@ void ControlFlowFlattening::RegisterFromAnnotation(Function &f,
         {"ControlFlowFlattening.UseOpaqueTransformationChance", args->Next()},
         {"ControlFlowFlattening.UseGlobalVariableOpaquesChance", args->Next()},
         {"ControlFlowFlattening.UseSipHashedStateChance", args->Next()},
-        {"ControlFlowFlattening.CloneSipHashChance", args->Next()}};
+        {"ControlFlowFlattening.CloneSipHashChance", args->Next()},
+        {"ControlFlowFlattening.DispatcherKind", args->Next()},
+        {"ControlFlowFlattening.Use32BitStates", args->Next()},
+        {"ControlFlowFlattening.ShareDispatcherKeys", args->Next()},
+        {"ControlFlowFlattening.BranchlessTransitions", args->Next()},
+        {"ControlFlowFlattening.DispatcherCopies", args->Next()},
+        {"ControlFlowFlattening.DispatcherCopiesMaxInstructions",
+         args->Next()},
+        {"ControlFlowFlattening.PreserveLoops", args->Next()},
+        {"ControlFlowFlattening.MaxChainLength", args->Next()},
+        {"ControlFlowFlattening.KeepHotEdgesPercent", args->Next()},
+        {"ControlFlowFlattening.SipHashTier", args->Next()}};
     ZyroxPassesMetadata::AddPass(f, pass_info.CodeName, kv);
 }
 
 void ControlFlowFlattening::ObfuscateFunction(Function &f,
                                               TransformationOptions *options)
 {
-    LLVMContext &ctx = f.getContext();
-
     if (f.size() < 2)
         return;
 
@@ -116,110 +271,305 @@ void ControlFlowFlattening::ObfuscateFunction(Function &f,
     unsigned ptr_size = dl.getPointerSize(0);
 
 #define IS_ARM32() (ptr_size == 4)
+    bool is_32bit = IS_ARM32() || options->Use32BitStates;
     IntegerType *int_ty =
-        IS_ARM32() ? builder.getInt32Ty() : builder.getInt64Ty();
-
-    AllocaInst *dispatcher_state =
-        builder.CreateAlloca(int_ty, nullptr, "state");
-    builder.CreateStore(ConstantInt::get(int_ty, 0), dispatcher_state, true);
+        is_32bit ? builder.getInt32Ty() : builder.getInt64Ty();
 
+    // blocks outside of marked regions and hot tight loops keep their direct
+    // edges, only the rest is moved behind the dispatcher.
+    std::vector<BasicBlock *> all_blocks;
     std::vector<BasicBlock *> original_blocks;
     for (auto &bb : f)
     {
-        if (&bb != &f.getEntryBlock())
+        all_blocks.push_back(&bb);
+        if (&bb != &f.getEntryBlock() && BasicBlockUtils::IsInRegion(&bb) &&
+            !HotnessUtils::IsTightLoop(&bb))
         {
             original_blocks.push_back(&bb);
         }
     }
 
-    std::map<BasicBlock *, uint64_t> block_state_map;
-    std::set<uint64_t> states;
-    for (auto *bb : original_blocks)
+    // a straight-line chain is visited with one dispatch, its blocks keep
+    // their edges and only every MaxChainLength-th one is flattened
+    if (options->MaxChainLength > 1)
+        CoarsenChains(original_blocks, options->MaxChainLength);
+
+    if (original_blocks.empty())
+        return;
+
+    // with PreserveLoops every outer loop gets its own dispatcher, its header
+    // and latches keep their edges and it stays a natural loop
+    std::vector<std::vector<BasicBlock *>> groups = {original_blocks};
+    if (options->PreserveLoops)
+        groups = GroupByLoop(f, original_blocks);
+
+    std::vector<BasicBlock *> flattened;
+    for (std::vector<BasicBlock *> &group : groups)
+        flattened.insert(flattened.end(), group.begin(), group.end());
+
+    if (flattened.empty())
+        return;
+
+    // picked before anything changes, frequencies are still the ones of the
+    // original edges. only blocks that really get flattened compete, edges
+    // into loop headers and latches stay direct anyway
+    DenseSet<Edge> kept_edges;
+    if (options->KeepHotEdgesPercent > 0)
     {
-        uint64_t state;
-        do
-        {
-            if (IS_ARM32())
-            {
-                state = Random::IntRanged<uint64_t>(0x000F0000, UINT32_MAX);
-            }
-            else
-            {
-                state = Random::IntRanged<uint64_t>(0x000F0000, UINT64_MAX);
-            }
-        } while (states.contains(state));
-        states.insert(state);
-        block_state_map[bb] = state;
-        BasicBlockUtils::AddMetaData(bb, "cff.dispatcher_state",
-                                     dispatcher_state);
-        BasicBlockUtils::AddMetaData(bb, "cff.block_state",
-                                     block_state_map[bb]);
+        kept_edges =
+            SelectHotEdges(f, flattened, options->KeepHotEdgesPercent);
     }
 
-    std::vector<BasicBlock *> condition_blocks;
-    for (int i = 0; i < original_blocks.size(); ++i)
+    // in barrier mode the slot may end up in a register, the stored states
+    // stay opaque so the dispatcher can't be folded back into branches.
+    bool is_volatile = BarrierUtils::VolatileScratch();
+
+    AllocaInst *dispatcher_state =
+        builder.CreateAlloca(int_ty, nullptr, "state");
+    builder.CreateStore(ConstantInt::get(int_ty, 0), dispatcher_state,
+                        is_volatile);
+
+    for (std::vector<BasicBlock *> &group : groups)
     {
-        BasicBlock *bb =
-            BasicBlock::Create(ctx, "cond_check." + std::to_string(i), &f);
-        condition_blocks.push_back(bb);
+        if (!group.empty())
+        {
+            FlattenBlocks(f, options, dispatcher_state, group, all_blocks,
+                          kept_edges);
+        }
     }
 
-    // branch to first condition block
-    // we create the jump from entry to dispatcher at the end.
-    BasicBlock *dispatch_bb = BasicBlock::Create(ctx, "dispatch", &f);
-    builder.SetInsertPoint(dispatch_bb);
-    builder.CreateBr(condition_blocks.front());
+    ZyroxAnalysis::Invalidate(f, PreservedAnalyses::none());
+}
 
-    Module *m = f.getParent();
+// one group per outer loop body and one for the blocks outside of loops.
+// headers and latches are left out, the back edges and their llvm.loop
+// metadata stay where loop passes expect them. innermost loops are left out
+// entirely, a dispatcher cycle inside one would become a new inner loop and
+// the vectorizer and full unrolling only handle innermost loops
+std::vector<std::vector<BasicBlock *>>
+GroupByLoop(Function &f, std::vector<BasicBlock *> &blocks)
+{
+    LoopInfo &li = ZyroxAnalysis::GetLoopInfo(f);
 
-    for (int i = 0; i < condition_blocks.size(); ++i)
+    DenseMap<Loop *, std::vector<BasicBlock *>> groups;
+    for (BasicBlock *bb : blocks)
     {
-        builder.SetInsertPoint(condition_blocks[i]);
+        Loop *loop = li.getLoopFor(bb);
 
-        uint64_t target_state = block_state_map[original_blocks[i]];
+        bool keep = li.isLoopHeader(bb) || (loop && loop->isInnermost());
+        for (Loop *l = loop; l && !keep; l = l->getParentLoop())
+            keep = l->isLoopLatch(bb);
+        if (keep)
+            continue;
 
-        Value *state_val =
-            builder.CreateLoad(int_ty, dispatcher_state, true, "state_val");
+        groups[loop].push_back(bb);
+    }
+
+    std::vector<std::vector<BasicBlock *>> result;
+    for (auto &[loop, group] : groups)
+        result.push_back(std::move(group));
+    return result;
+}
+
+// the percent most frequent edges into flattened blocks (by block frequency,
+// so by profile counts when there is a profile) stay direct branches
+DenseSet<Edge> SelectHotEdges(Function &f, std::vector<BasicBlock *> &blocks,
+                              int percent)
+{
+    BlockFrequencyInfo &bfi = ZyroxAnalysis::GetBlockFrequency(f);
+    BranchProbabilityInfo &bpi = ZyroxAnalysis::GetBranchProbability(f);
+    SmallPtrSet<BasicBlock *, 32> flattened(blocks.begin(), blocks.end());
 
-        Value *cmp;
-        if (Random::Chance(options->UseFunctionResolverChance))
+    std::vector<std::pair<uint64_t, Edge>> edges;
+    DenseSet<Edge> seen;
+    for (BasicBlock &bb : f)
+    {
+        if (!isa<BranchInst>(bb.getTerminator()))
+            continue;
+
+        for (BasicBlock *succ : successors(&bb))
         {
-            Function *state_resolver = CreateFunctionForStateResolverCheck(
-                m, target_state, options, states, IS_ARM32());
-            cmp = builder.CreateCall(state_resolver, {state_val});
+            if (!flattened.contains(succ) || !seen.insert({&bb, succ}).second)
+                continue;
+
+            BlockFrequency freq =
+                bfi.getBlockFreq(&bb) * bpi.getEdgeProbability(&bb, succ);
+            edges.push_back({freq.getFrequency(), {&bb, succ}});
         }
+    }
+
+    std::ranges::sort(edges, std::greater<>(),
+                      &std::pair<uint64_t, Edge>::first);
+
+    DenseSet<Edge> kept;
+    size_t kept_count = edges.size() * std::min(percent, 100) / 100;
+    double total = 0, dispatched = 0;
+    for (size_t i = 0; i < edges.size(); i++)
+    {
+        total += edges[i].first;
+        if (i < kept_count)
+            kept.insert(edges[i].second);
         else
+            dispatched += edges[i].first;
+    }
+
+    if (!edges.empty())
+    {
+        Logger::Info("ControlFlowFlattening: {} keeps {} of {} edges direct, "
+                     "{:.1f}% of the transitions still go through the "
+                     "dispatcher.",
+                     demangle(f.getName()), kept.size(), edges.size(),
+                     total > 0 ? 100 * dispatched / total : 100.0);
+    }
+    return kept;
+}
+
+// position of bb in its straight-line chain (blocks only reached by an
+// unconditional branch of the block before them), 0 for the chain head
+int ChainPosition(BasicBlock *bb, DenseMap<BasicBlock *, int> &positions)
+{
+    // walk back to the head (or an already numbered block), then number the
+    // path on the way forward
+    std::vector<BasicBlock *> path;
+    SmallPtrSet<BasicBlock *, 16> on_path;
+    while (!positions.count(bb))
+    {
+        path.push_back(bb);
+        on_path.insert(bb);
+        BasicBlock *pred = bb->getSinglePredecessor();
+        if (!pred || pred->getSingleSuccessor() != bb ||
+            !isa<BranchInst>(pred->getTerminator()) || on_path.contains(pred))
         {
-            MaybeTransformDispatcherState(m, builder, state_val, target_state,
-                                          options, states, IS_ARM32());
-            cmp = builder.CreateICmpEQ(
-                state_val,
-                GetTargetState(m, builder, target_state, options, IS_ARM32()));
+            positions[bb] = 0;
+            path.pop_back();
+            break;
         }
+        bb = pred;
+    }
 
-        if (i < condition_blocks.size() - 1)
+    int position = positions[bb];
+    for (auto it = path.rbegin(); it != path.rend(); ++it)
+        positions[*it] = ++position;
+    return position;
+}
+
+void CoarsenChains(std::vector<BasicBlock *> &blocks, int max_chain_length)
+{
+    DenseMap<BasicBlock *, int> positions;
+    std::vector<BasicBlock *> flattened;
+    for (BasicBlock *bb : blocks)
+    {
+        if (ChainPosition(bb, positions) % max_chain_length == 0)
+            flattened.push_back(bb);
+    }
+    blocks = flattened;
+}
+
+void FlattenBlocks(Function &f,
+                   ControlFlowFlattening::TransformationOptions *options,
+                   AllocaInst *dispatcher_state,
+                   std::vector<BasicBlock *> &original_blocks,
+                   std::vector<BasicBlock *> &all_blocks,
+                   DenseSet<Edge> &kept_edges)
+{
+    LLVMContext &ctx = f.getContext();
+    IRBuilder<> builder(ctx);
+
+    auto *int_ty = cast<IntegerType>(dispatcher_state->getAllocatedType());
+    bool is_32bit = int_ty->getBitWidth() == 32;
+    bool has_regions = f.hasMetadata("zyrox.regions");
+    bool is_volatile = BarrierUtils::VolatileScratch();
+
+    uint64_t max_state = is_32bit ? UINT32_MAX : UINT64_MAX;
+
+    // jump table states are a shuffled 0..n-1 behind a random key, the
+    // dispatcher gets the index back with a single xor
+    uint64_t state_key = Random::IntRanged<uint64_t>(0x000F0000, max_state);
+    std::vector<uint64_t> indices(original_blocks.size());
+    std::iota(indices.begin(), indices.end(), 0);
+    std::random_device rd;
+    std::mt19937 rng(rd());
+    std::ranges::shuffle(indices, rng);
+
+    DenseMap<BasicBlock *, uint64_t> block_state_map;
+    DispatcherStates states;
+    for (int i = 0; i < original_blocks.size(); ++i)
+    {
+        BasicBlock *bb = original_blocks[i];
+        uint64_t state;
+        if (options->DispatcherKind ==
+            ControlFlowFlattening::DispatcherJumpTable)
         {
-            // not last block: branch to target or next condition
-            builder.CreateCondBr(cmp, original_blocks[i],
-                                 condition_blocks[i + 1]);
+            state = indices[i] ^ state_key;
         }
         else
         {
-            // last block: branch to target or default (first block)
-            BasicBlock *default_bb = BasicBlock::Create(ctx, "default", &f);
-            IRBuilder<> default_bb_ir(default_bb);
-            default_bb_ir.CreateBr(dispatch_bb);
-
-            builder.CreateCondBr(cmp, original_blocks[i], default_bb);
+            do
+            {
+                state = Random::IntRanged<uint64_t>(0x000F0000, max_state);
+            } while (states.values.contains(state));
         }
+        states.values.insert(state);
+        block_state_map[bb] = state;
+        BasicBlockUtils::AddMetaData(bb, "cff.dispatcher_state",
+                                     dispatcher_state);
+        BasicBlockUtils::AddMetaData(bb, "cff.block_state",
+                                     block_state_map[bb]);
+    }
+
+    // we create the jump from entry to dispatcher at the end.
+    BasicBlock *dispatch_bb = BasicBlock::Create(ctx, "dispatch", &f);
+
+    // only reachable with a state that matches no block, keep it out of the
+    // hot layout (and in the cold part with -fsplit-machine-functions)
+    BasicBlock *default_bb = BasicBlock::Create(ctx, "default", &f);
+    IRBuilder<> default_bb_ir(default_bb);
+    default_bb_ir.CreateBr(dispatch_bb);
+    BasicBlockUtils::Tag(default_bb, "zyrox.cold");
+
+    DispatcherContext dc = {
+        .m = f.getParent(),
+        .state = dispatcher_state,
+        .dispatch_bb = dispatch_bb,
+        .default_bb = default_bb,
+        .options = options,
+        .states = &states,
+        .is_32bit = is_32bit,
+        .is_volatile = is_volatile,
+        .blocks = {dispatch_bb, default_bb},
+    };
+
+    switch (options->DispatcherKind)
+    {
+    case ControlFlowFlattening::DispatcherBinarySearch:
+        BuildBinarySearchDispatcher(dc, original_blocks, block_state_map);
+        break;
+    case ControlFlowFlattening::DispatcherJumpTable:
+        BuildJumpTableDispatcher(dc, original_blocks, block_state_map,
+                                 state_key);
+        break;
+    default:
+        BuildLinearDispatcher(dc, original_blocks, block_state_map);
+        break;
+    }
+
+    for (BasicBlock *bb : dc.blocks)
+    {
+        BasicBlockUtils::Tag(bb, "zyrox.created");
+        if (has_regions)
+            BasicBlockUtils::Tag(bb, "zyrox.region");
     }
 
     // modify state and return to dispatcher
     // entry block could have a condition so we cannot just put a Br and call it
     // a day.
-    // so we just handle it as any other block.
-    original_blocks.push_back(&f.getEntryBlock());
-    for (auto *bb : original_blocks)
+    // so we just handle it as any other block, same for blocks outside of the
+    // regions that jump into one.
+    // hot edges kept by KeepHotEdgesPercent stay direct branches.
+    auto flattened = [&](BasicBlock *from, BasicBlock *to)
+    { return block_state_map.count(to) && !kept_edges.contains({from, to}); };
+
+    for (auto *bb : all_blocks)
     {
         Instruction *terminator = bb->getTerminator();
         builder.SetInsertPoint(terminator);
@@ -229,10 +579,17 @@ void ControlFlowFlattening::ObfuscateFunction(Function &f,
             if (br->isUnconditional())
             {
                 BasicBlock *target = br->getSuccessor(0);
+                if (!flattened(bb, target))
+                    continue;
+
                 builder.CreateStore(
-                    ConstantInt::get(int_ty, block_state_map[target]),
-                    dispatcher_state, true);
-                terminator->replaceAllUsesWith(builder.CreateBr(dispatch_bb));
+                    BarrierUtils::Opaque(
+                        builder,
+                        ConstantInt::get(int_ty, block_state_map[target])),
+                    dispatcher_state, is_volatile);
+                Instruction *new_br = builder.CreateBr(dispatch_bb);
+                BasicBlockUtils::InheritTags(terminator, new_br);
+                terminator->replaceAllUsesWith(new_br);
                 terminator->eraseFromParent();
             }
             else
@@ -240,44 +597,418 @@ void ControlFlowFlattening::ObfuscateFunction(Function &f,
                 BasicBlock *true_bb = br->getSuccessor(0);
                 BasicBlock *false_bb = br->getSuccessor(1);
 
-                BasicBlock *true_state =
-                    BasicBlock::Create(ctx, "cff.block.true_state", &f);
-                BasicBlock *false_state =
-                    BasicBlock::Create(ctx, "cff.block.false_state", &f);
+                if (!flattened(bb, true_bb) && !flattened(bb, false_bb))
+                    continue;
 
-                builder.SetInsertPoint(true_state);
-                builder.CreateStore(
-                    ConstantInt::get(int_ty, block_state_map[true_bb]),
-                    dispatcher_state, true);
-                builder.CreateBr(dispatch_bb);
+                if (options->BranchlessTransitions && flattened(bb, true_bb) &&
+                    flattened(bb, false_bb))
+                {
+                    // state = false ^ (-cond & (true ^ false)), no
+                    // trampolines and no conditional branch left to predict
+                    uint64_t true_state = block_state_map[true_bb];
+                    uint64_t false_state = block_state_map[false_bb];
+                    Value *mask = builder.CreateNeg(
+                        builder.CreateZExt(br->getCondition(), int_ty));
+                    Value *diff = BarrierUtils::Opaque(
+                        builder,
+                        ConstantInt::get(int_ty, true_state ^ false_state));
+                    Value *next_state = builder.CreateXor(
+                        BarrierUtils::Opaque(
+                            builder, ConstantInt::get(int_ty, false_state)),
+                        builder.CreateAnd(mask, diff), "next_state");
+                    builder.CreateStore(next_state, dispatcher_state,
+                                        is_volatile);
+                    Instruction *new_br = builder.CreateBr(dispatch_bb);
+                    BasicBlockUtils::InheritTags(terminator, new_br);
+                    terminator->replaceAllUsesWith(new_br);
+                    terminator->eraseFromParent();
+                    continue;
+                }
 
-                builder.SetInsertPoint(false_state);
-                builder.CreateStore(
-                    ConstantInt::get(int_ty, block_state_map[false_bb]),
-                    dispatcher_state, true);
-                builder.CreateBr(dispatch_bb);
+                BasicBlock *true_state = true_bb;
+                BasicBlock *false_state = false_bb;
+
+                if (flattened(bb, true_bb))
+                {
+                    true_state =
+                        BasicBlock::Create(ctx, "cff.block.true_state", &f);
+                    builder.SetInsertPoint(true_state);
+                    Constant *state =
+                        ConstantInt::get(int_ty, block_state_map[true_bb]);
+                    builder.CreateStore(BarrierUtils::Opaque(builder, state),
+                                        dispatcher_state, is_volatile);
+                    builder.CreateBr(dispatch_bb);
+                    BasicBlockUtils::Tag(true_state, "zyrox.created");
+                    if (has_regions)
+                        BasicBlockUtils::Tag(true_state, "zyrox.region");
+                }
+
+                if (flattened(bb, false_bb))
+                {
+                    false_state =
+                        BasicBlock::Create(ctx, "cff.block.false_state", &f);
+                    builder.SetInsertPoint(false_state);
+                    Constant *state =
+                        ConstantInt::get(int_ty, block_state_map[false_bb]);
+                    builder.CreateStore(BarrierUtils::Opaque(builder, state),
+                                        dispatcher_state, is_volatile);
+                    builder.CreateBr(dispatch_bb);
+                    BasicBlockUtils::Tag(false_state, "zyrox.created");
+                    if (has_regions)
+                        BasicBlockUtils::Tag(false_state, "zyrox.region");
+                }
 
                 builder.SetInsertPoint(terminator);
 
-                terminator->replaceAllUsesWith(builder.CreateCondBr(
-                    br->getCondition(), true_state, false_state));
+                Instruction *new_br = builder.CreateCondBr(
+                    br->getCondition(), true_state, false_state);
+                BasicBlockUtils::InheritTags(terminator, new_br);
+                // a latch keeping its back edge keeps its loop metadata
+                new_br->copyMetadata(*terminator, {LLVMContext::MD_loop});
+                terminator->replaceAllUsesWith(new_br);
                 terminator->eraseFromParent();
             }
         }
     }
 
-    FunctionUtils::DemoteRegToStack(f);
+    if (options->DispatcherCopies > 1)
+    {
+        ReplicateDispatcher(dc, options->DispatcherCopies,
+                            options->DispatcherCopiesMaxInstructions);
+    }
+}
+
+// with shared keys the state was already hashed/transformed by the
+// dispatcher, the check only compares
+Value *CreateStateCheck(DispatcherContext &dc, IRBuilderBase &builder,
+                        Value *state_val, uint64_t target_state)
+{
+    bool transform_state = !dc.options->ShareDispatcherKeys;
+
+    if (Random::Chance(dc.options->UseFunctionResolverChance))
+    {
+        Function *state_resolver = CreateFunctionForStateResolverCheck(
+            dc.m, target_state, dc.options, *dc.states, dc.is_32bit,
+            transform_state);
+        if (dc.options->IsColdFunction)
+            HotnessUtils::MarkCold(*state_resolver);
+        return builder.CreateCall(state_resolver, {state_val});
+    }
+
+    if (transform_state)
+    {
+        MaybeTransformDispatcherState(dc.m, builder, state_val, target_state,
+                                      dc.options, *dc.states, dc.is_32bit);
+    }
+    return builder.CreateICmpEQ(state_val,
+                                GetTargetState(dc.m, builder, target_state,
+                                               dc.options, dc.is_32bit));
+}
+
+// the last check of a path: the target or the default block, which is only
+// reached with a state that matches no block
+void CreateDefaultCheck(DispatcherContext &dc, IRBuilderBase &builder,
+                        Value *cmp, BasicBlock *target)
+{
+    BranchInst *br = builder.CreateCondBr(cmp, target, dc.default_bb);
+    br->setMetadata(
+        LLVMContext::MD_prof,
+        MDBuilder(builder.getContext()).createBranchWeights(1 << 20, 1));
+}
+
+// hashes/transforms the state once for the whole dispatcher with a single
+// key set, the targets are transformed the same way at compile time
+Value *TransformSharedState(DispatcherContext &dc, IRBuilderBase &builder,
+                            Value *state_val,
+                            std::vector<uint64_t> &target_states)
+{
+    uint64_t mask = dc.is_32bit ? UINT32_MAX : UINT64_MAX;
+
+    // every state of the dispatcher has to keep a distinct image, otherwise
+    // a check would match more than one block
+    std::unordered_map<uint64_t, uint64_t> images;
+    auto is_distinct = [&]()
+    {
+        std::unordered_set<uint64_t> seen;
+        for (auto &[state, image] : images)
+        {
+            if (!seen.insert(image).second)
+                return false;
+        }
+        return true;
+    };
+
+    for (uint64_t state : dc.states->values)
+        images[state] = state;
+
+    if (Random::Chance(dc.options->UseSipHashedStateChance))
+    {
+        uint64_t keys[6];
+        auto [c_rounds, d_rounds] = SipHashRounds(dc.options);
+        do
+        {
+            for (uint64_t &key : keys)
+                key = Random::IntRanged<uint64_t>(0x000F0000, UINT64_MAX);
+            for (auto &[state, image] : images)
+            {
+                image = HashUtils::SipHash(state, keys[0], keys[1], keys[2],
+                                           keys[3], keys[4], keys[5],
+                                           c_rounds, d_rounds) &
+                        mask;
+            }
+        } while (!is_distinct());
+
+        state_val = CreateSipHashCall(dc.m, builder, state_val, keys,
+                                      dc.options, dc.is_32bit);
+    }
+
+    if (Random::Chance(dc.options->UseOpaqueTransformationChance))
+    {
+        std::unordered_map<uint64_t, uint64_t> hashed = images;
+        while (true)
+        {
+            OpaqueTransformer transformer(dc.is_32bit);
+            for (auto &[state, image] : images)
+                image = transformer.TransformConstant(hashed[state]) & mask;
+            if (is_distinct())
+            {
+                state_val = transformer.Transform(
+                    *dc.m, builder, state_val,
+                    dc.options->UseGlobalVariableOpaquesChance);
+                break;
+            }
+        }
+    }
+
+    for (uint64_t &target_state : target_states)
+        target_state = images[target_state];
+    return state_val;
+}
+
+void BuildLinearDispatcher(DispatcherContext &dc,
+                           std::vector<BasicBlock *> &targets,
+                           DenseMap<BasicBlock *, uint64_t> &block_state_map)
+{
+    Function *f = dc.dispatch_bb->getParent();
+    Type *int_ty = dc.state->getAllocatedType();
+
+    std::vector<BasicBlock *> condition_blocks;
+    for (int i = 0; i < targets.size(); ++i)
+    {
+        BasicBlock *bb = BasicBlock::Create(
+            f->getContext(), "cond_check." + std::to_string(i), f);
+        condition_blocks.push_back(bb);
+        dc.blocks.push_back(bb);
+    }
+
+    std::vector<uint64_t> target_states;
+    for (BasicBlock *bb : targets)
+        target_states.push_back(block_state_map[bb]);
+
+    IRBuilder<> builder(dc.dispatch_bb);
+
+    Value *shared_state = nullptr;
+    if (dc.options->ShareDispatcherKeys)
+    {
+        shared_state = builder.CreateLoad(int_ty, dc.state, dc.is_volatile,
+                                          "state_val");
+        shared_state =
+            TransformSharedState(dc, builder, shared_state, target_states);
+    }
+
+    // branch to first condition block
+    builder.CreateBr(condition_blocks.front());
+
+    for (int i = 0; i < condition_blocks.size(); ++i)
+    {
+        builder.SetInsertPoint(condition_blocks[i]);
+
+        Value *state_val = shared_state;
+        if (!state_val)
+        {
+            state_val = builder.CreateLoad(int_ty, dc.state, dc.is_volatile,
+                                           "state_val");
+        }
+        Value *cmp = CreateStateCheck(dc, builder, state_val, target_states[i]);
+
+        if (i < condition_blocks.size() - 1)
+        {
+            // not last block: branch to target or next condition
+            builder.CreateCondBr(cmp, targets[i], condition_blocks[i + 1]);
+        }
+        else
+        {
+            CreateDefaultCheck(dc, builder, cmp, targets[i]);
+        }
+    }
+}
+
+BasicBlock *
+BuildSearchNode(DispatcherContext &dc, Value *state_val,
+                std::vector<std::pair<uint64_t, BasicBlock *>> &sorted,
+                size_t begin, size_t end)
+{
+    Function *f = dc.dispatch_bb->getParent();
+    BasicBlock *node = BasicBlock::Create(f->getContext(), "search_node", f);
+    dc.blocks.push_back(node);
+    IRBuilder<> builder(node);
+
+    if (end - begin == 1)
+    {
+        // the tree only narrowed the range down, the leaf still has to check
+        // the state itself
+        auto [target_state, target] = sorted[begin];
+        Value *cmp = CreateStateCheck(dc, builder, state_val, target_state);
+        CreateDefaultCheck(dc, builder, cmp, target);
+        return node;
+    }
+
+    size_t mid = begin + (end - begin) / 2;
+    BasicBlock *low = BuildSearchNode(dc, state_val, sorted, begin, mid);
+    BasicBlock *high = BuildSearchNode(dc, state_val, sorted, mid, end);
+
+    Value *pivot = GetTargetState(dc.m, builder, sorted[mid].first,
+                                  dc.options, dc.is_32bit);
+    builder.CreateCondBr(builder.CreateICmpULT(state_val, pivot), low, high);
+    return node;
+}
+
+void BuildBinarySearchDispatcher(
+    DispatcherContext &dc, std::vector<BasicBlock *> &targets,
+    DenseMap<BasicBlock *, uint64_t> &block_state_map)
+{
+    std::vector<uint64_t> target_states;
+    for (BasicBlock *bb : targets)
+        target_states.push_back(block_state_map[bb]);
+
+    // a single load, every node of the tree compares the same value
+    IRBuilder<> builder(dc.dispatch_bb);
+    Value *state_val = builder.CreateLoad(dc.state->getAllocatedType(),
+                                          dc.state, dc.is_volatile,
+                                          "state_val");
+
+    // with shared keys the tree is built over the transformed states
+    if (dc.options->ShareDispatcherKeys)
+    {
+        state_val = TransformSharedState(dc, builder, state_val, target_states);
+    }
+
+    std::vector<std::pair<uint64_t, BasicBlock *>> sorted;
+    for (int i = 0; i < targets.size(); ++i)
+        sorted.emplace_back(target_states[i], targets[i]);
+    std::ranges::sort(sorted, {}, &std::pair<uint64_t, BasicBlock *>::first);
+
+    builder.CreateBr(BuildSearchNode(dc, state_val, sorted, 0, sorted.size()));
+}
+
+void BuildJumpTableDispatcher(DispatcherContext &dc,
+                              std::vector<BasicBlock *> &targets,
+                              DenseMap<BasicBlock *, uint64_t> &block_state_map,
+                              uint64_t state_key)
+{
+    IRBuilder<> builder(dc.dispatch_bb);
+    auto *int_ty = cast<IntegerType>(dc.state->getAllocatedType());
+
+    // a known key would let llvm fold `switch (state ^ key)` back into a
+    // switch over the sparse states, and the table with it
+    GlobalVariable *gv = new GlobalVariable(
+        *dc.m, int_ty, false, GlobalValue::PrivateLinkage,
+        ConstantInt::get(int_ty, state_key), "__state_key");
+    Value *key = builder.CreateLoad(int_ty, BarrierUtils::Opaque(builder, gv),
+                                    BarrierUtils::VolatileScratch());
+
+    Value *state_val = builder.CreateLoad(int_ty, dc.state, dc.is_volatile,
+                                          "state_val");
+    Value *index = builder.CreateXor(state_val, key, "state_index");
+
+    SwitchInst *sw = builder.CreateSwitch(index, dc.default_bb, targets.size());
+    for (BasicBlock *bb : targets)
+    {
+        sw->addCase(ConstantInt::get(int_ty, block_state_map[bb] ^ state_key),
+                    bb);
+    }
+    BasicBlockUtils::Tag(sw, "zyrox.dispatch");
+}
+
+// every copy of the dispatcher gets its own share of the predecessors, so
+// its branches build their own history in the predictor
+void ReplicateDispatcher(DispatcherContext &dc, int copies,
+                         int max_instructions)
+{
+    Function *f = dc.dispatch_bb->getParent();
+
+    size_t dispatcher_size = 0;
+    for (BasicBlock *bb : dc.blocks)
+        dispatcher_size += bb->size();
+
+    SmallPtrSet<BasicBlock *, 32> dispatcher(dc.blocks.begin(),
+                                             dc.blocks.end());
+    SmallPtrSet<BasicBlock *, 32> seen;
+    std::vector<BasicBlock *> preds;
+    for (BasicBlock *pred : predecessors(dc.dispatch_bb))
+    {
+        if (!dispatcher.contains(pred) && seen.insert(pred).second)
+            preds.push_back(pred);
+    }
+
+    // the original is copy 0, extra copies are capped by the size budget and
+    // there is no point in more copies than predecessors
+    size_t wanted_copies = copies - 1;
+    size_t extra_copies = std::min<size_t>(
+        {wanted_copies, max_instructions / dispatcher_size,
+         preds.empty() ? 0 : preds.size() - 1});
+    if (extra_copies < wanted_copies)
+    {
+        Logger::Info("ControlFlowFlattening: {} dispatcher copies for {} "
+                     "instead of {}, dispatcher is {} instructions.",
+                     extra_copies + 1, demangle(f->getName()), copies,
+                     dispatcher_size);
+    }
+    if (extra_copies == 0)
+        return;
+
+    std::vector<BasicBlock *> entries = {dc.dispatch_bb};
+    for (size_t i = 1; i <= extra_copies; i++)
+    {
+        ValueToValueMapTy vmap;
+        SmallVector<BasicBlock *, 16> clones;
+        for (BasicBlock *bb : dc.blocks)
+        {
+            BasicBlock *clone =
+                CloneBasicBlock(bb, vmap, ".copy" + std::to_string(i), f);
+            vmap[bb] = clone;
+            clones.push_back(clone);
+        }
+        remapInstructionsInBlocks(clones, vmap);
+        entries.push_back(cast<BasicBlock>(vmap[dc.dispatch_bb]));
+    }
+
+    // random groups, with the profile the hot predecessors go first so they
+    // end up in different copies
+    std::random_device rd;
+    std::mt19937 rng(rd());
+    std::ranges::shuffle(preds, rng);
+    std::ranges::stable_partition(
+        preds, [](BasicBlock *bb) { return HotnessUtils::IsHot(bb); });
+
+    for (size_t i = 0; i < preds.size(); i++)
+    {
+        BasicBlock *entry = entries[i % entries.size()];
+        if (entry != dc.dispatch_bb)
+            preds[i]->getTerminator()->replaceSuccessorWith(dc.dispatch_bb,
+                                                            entry);
+    }
 }
 
 Function *CreateFunctionForStateResolverCheck(
     Module *m, uint64_t target_state,
     ControlFlowFlattening::TransformationOptions *options,
-    std::set<uint64_t> &states, bool is_arm32)
+    DispatcherStates &states, bool is_32bit, bool transform_state)
 {
     LLVMContext &ctx = m->getContext();
     FunctionType *function_ty = FunctionType::get(
         Type::getInt1Ty(ctx),
-        {is_arm32 ? Type::getInt32Ty(ctx) : Type::getInt64Ty(ctx)}, false);
+        {is_32bit ? Type::getInt32Ty(ctx) : Type::getInt64Ty(ctx)}, false);
     Function *f = Function::Create(function_ty, GlobalValue::InternalLinkage,
                                    "cff_resolve_state_check", m);
 
@@ -287,11 +1018,14 @@ Function *CreateFunctionForStateResolverCheck(
     IRBuilder builder(state_resolver_block);
 
     Value *state_arg = f->getArg(0);
-    MaybeTransformDispatcherState(m, builder, state_arg, target_state, options,
-                                  states, is_arm32);
+    if (transform_state)
+    {
+        MaybeTransformDispatcherState(m, builder, state_arg, target_state,
+                                      options, states, is_32bit);
+    }
 
     Value *cmp = builder.CreateICmpEQ(
-        state_arg, GetTargetState(m, builder, target_state, options, is_arm32));
+        state_arg, GetTargetState(m, builder, target_state, options, is_32bit));
 
     builder.CreateRet(cmp);
 
@@ -300,21 +1034,23 @@ Function *CreateFunctionForStateResolverCheck(
 
 Value *GetTargetState(Module *m, IRBuilderBase &builder, uint64_t target_state,
                       ControlFlowFlattening::TransformationOptions *options,
-                      bool is_arm32)
+                      bool is_32bit)
 {
     if (Random::Chance(options->UseGlobalStateVariablesChance))
     {
         GlobalVariable *gv = new GlobalVariable(
-            *m, is_arm32 ? builder.getInt32Ty() : builder.getInt64Ty(), false,
+            *m, is_32bit ? builder.getInt32Ty() : builder.getInt64Ty(), false,
             GlobalValue::PrivateLinkage,
-            is_arm32 ? builder.getInt32(target_state)
+            is_32bit ? builder.getInt32(target_state)
                      : builder.getInt64(target_state),
             "__state_" + std::to_string(target_state));
 
         return builder.CreateLoad(
-            is_arm32 ? builder.getInt32Ty() : builder.getInt64Ty(), gv, true);
+            is_32bit ? builder.getInt32Ty() : builder.getInt64Ty(),
+            BarrierUtils::Opaque(builder, gv),
+            BarrierUtils::VolatileScratch());
     }
-    return is_arm32 ? builder.getInt32(target_state)
+    return is_32bit ? builder.getInt32(target_state)
                     : builder.getInt64(target_state);
 }
 
@@ -322,81 +1058,230 @@ void MaybeTransformDispatcherState(
     Module *m, IRBuilderBase &builder, Value *&dispatcher_state,
     uint64_t &target_state,
     ControlFlowFlattening::TransformationOptions *options,
-    std::set<uint64_t> &states, bool is_arm32)
+    DispatcherStates &states, bool is_32bit)
 {
     if (Random::Chance(options->UseSipHashedStateChance))
     {
-        uint64_t hashed_state = 0;
+        uint64_t mask = is_32bit ? UINT32_MAX : UINT64_MAX;
+        auto [c_rounds, d_rounds] = SipHashRounds(options);
         while (true)
         {
-            uint64_t SipHashStateOptions[] = {
-                Random::IntRanged<uint64_t>(0x000F0000, UINT64_MAX), // k0
-                Random::IntRanged<uint64_t>(0x000F0000, UINT64_MAX), // k1
-                Random::IntRanged<uint64_t>(0x000F0000, UINT64_MAX), // v0
-                Random::IntRanged<uint64_t>(0x000F0000, UINT64_MAX), // v1
-                Random::IntRanged<uint64_t>(0x000F0000, UINT64_MAX), // v2
-                Random::IntRanged<uint64_t>(0x000F0000, UINT64_MAX), // v3
-            };
-#define ARG(n) SipHashStateOptions[n]
-#define SIPHASH(a1, a2, a3, a4, a5, a6, a7)                                    \
-    (HashUtils::SipHash(a1, a2, a3, a4, a5, a6, a7) &                          \
-     (is_arm32 ? UINT32_MAX : UINT64_MAX))
-
-            hashed_state = SIPHASH(target_state, ARG(0), ARG(1), ARG(2), ARG(3),
-                                   ARG(4), ARG(5));
-            int collisions_count = 0;
-            for (uint64_t state : states)
-            {
-                if (SIPHASH(state, ARG(0), ARG(1), ARG(2), ARG(3), ARG(4),
-                            ARG(5)) == hashed_state)
-                {
-                    collisions_count++;
-                }
-            }
+            if (states.siphash_batch_left == 0)
+                DrawSipHashKeys(states, mask, options);
+            states.siphash_batch_left--;
+
+#define ARG(n) states.siphash_keys[n]
+            uint64_t hashed_state =
+                HashUtils::SipHash(target_state, ARG(0), ARG(1), ARG(2),
+                                   ARG(3), ARG(4), ARG(5), c_rounds,
+                                   d_rounds) &
+                mask;
 #undef ARG
-            if (collisions_count == 1 && !states.contains(hashed_state))
+            auto it = states.siphash_counts.find(hashed_state);
+            if (it != states.siphash_counts.end() && it->second == 1 &&
+                !states.values.contains(hashed_state))
             {
                 // only TargetState matches this hashed output
                 target_state = hashed_state;
-#define ARG(n) builder.getInt64(SipHashStateOptions[n])
-                Function *fn = sip_hash_fn;
-
-                if (Random::Chance(options->CloneSipHashChance))
-                {
-                    ValueToValueMapTy vmap;
-                    fn = CloneFunction(sip_hash_fn, vmap);
-                    fn->setLinkage(GlobalValue::InternalLinkage);
-                    // cross fingers later passes will apply this, lol. llvm
-                    // will use a threshold so it won't be THAT bad
-                    fn->addFnAttr(Attribute::AlwaysInline);
-                    fn->removeFnAttr(Attribute::NoInline);
-
-                    assert(!verifyFunction(*fn, &errs()) &&
-                           "Cloned function is broken!");
-                }
-
-                Value *value = builder.CreateCall(
-                    fn,
-                    {is_arm32 ? builder.CreateZExt(dispatcher_state,
-                                                   builder.getInt64Ty(), "zext")
-                              : dispatcher_state,
-                     ARG(0), ARG(1), ARG(2), ARG(3), ARG(4), ARG(5)});
-
                 dispatcher_state =
-                    is_arm32 ? builder.CreateTrunc(value, builder.getInt32Ty(),
-                                                   "trunc")
-                             : value;
-#undef ARG
+                    CreateSipHashCall(m, builder, dispatcher_state,
+                                      states.siphash_keys, options, is_32bit);
                 break;
             }
+
+            // collides for this state, the batch is over
+            states.siphash_batch_left = 0;
         }
     }
     if (Random::Chance(options->UseOpaqueTransformationChance))
     {
-        OpaqueTransformer transformer(is_arm32);
+        OpaqueTransformer transformer(is_32bit);
         dispatcher_state =
             transformer.Transform(*m, builder, dispatcher_state,
                                   options->UseGlobalVariableOpaquesChance);
         target_state = transformer.TransformConstant(target_state);
     }
-}
\ No newline at end of file
+}
+
+Value *CreateSipHashCall(Module *m, IRBuilderBase &builder, Value *state,
+                         const uint64_t keys[6],
+                         ControlFlowFlattening::TransformationOptions *options,
+                         bool is_32bit)
+{
+    bool can_inline = sip_hash_inlined_instructions <
+                      ZyroxModuleOptions::Get("SipHash.MaxInlinedInstructions",
+                                              50000);
+
+    Value *in =
+        is_32bit ? builder.CreateZExt(state, builder.getInt64Ty(), "zext")
+                 : state;
+    Value *key_values[6];
+    for (int i = 0; i < 6; i++)
+        key_values[i] = builder.getInt64(keys[i]);
+
+    Value *value;
+    if (options->SipHashTier != ControlFlowFlattening::SipHashShared &&
+        can_inline)
+    {
+        // the keys are constants, the builder folds their part of the rounds
+        auto [c_rounds, d_rounds] = SipHashRounds(options);
+        size_t size_before = builder.GetInsertBlock()->size();
+        value = EmitSipHash(builder, in, key_values, c_rounds, d_rounds);
+        sip_hash_inlined_instructions +=
+            builder.GetInsertBlock()->size() - size_before;
+    }
+    else
+    {
+        Function *fn =
+            options->SipHashTier == ControlFlowFlattening::SipHashReduced
+                ? GetReducedSipHash(m)
+                : sip_hash_fn;
+
+        if (options->SipHashTier == ControlFlowFlattening::SipHashShared &&
+            can_inline && Random::Chance(options->CloneSipHashChance))
+        {
+            fn = CloneSipHash();
+            // the clone is inlined into every caller, reused ones too
+            if (fn != sip_hash_fn)
+                sip_hash_inlined_instructions += fn->getInstructionCount();
+        }
+
+        value = builder.CreateCall(fn, {in, key_values[0], key_values[1],
+                                        key_values[2], key_values[3],
+                                        key_values[4], key_values[5]});
+    }
+
+    return is_32bit ? builder.CreateTrunc(value, builder.getInt32Ty(), "trunc")
+                    : value;
+}
+
+Function *CloneSipHash()
+{
+    size_t max_clones = ZyroxModuleOptions::Get("SipHash.MaxClones", 32);
+    if (sip_hash_clones.size() >= max_clones)
+    {
+        if (sip_hash_clones.empty())
+            return sip_hash_fn;
+        return sip_hash_clones[Random::IntRanged<size_t>(
+            0, sip_hash_clones.size() - 1)];
+    }
+
+    ValueToValueMapTy vmap;
+    Function *fn = CloneFunction(sip_hash_fn, vmap);
+    fn->setLinkage(GlobalValue::InternalLinkage);
+    // cross fingers later passes will apply this, lol. llvm will use a
+    // threshold so it won't be THAT bad
+    fn->addFnAttr(Attribute::AlwaysInline);
+    fn->removeFnAttr(Attribute::NoInline);
+
+    assert(!verifyFunction(*fn, &errs()) && "Cloned function is broken!");
+
+    sip_hash_clones.push_back(fn);
+    return fn;
+}
+
+Function *GetReducedSipHash(Module *m)
+{
+    if (reduced_sip_hash_fn != nullptr)
+        return reduced_sip_hash_fn;
+
+    reduced_sip_hash_fn =
+        Function::Create(sip_hash_fn->getFunctionType(),
+                         GlobalValue::InternalLinkage, "___siphash_1_2", m);
+    reduced_sip_hash_fn->addFnAttr(Attribute::NoInline);
+    reduced_sip_hash_fn->setDoesNotAccessMemory();
+    reduced_sip_hash_fn->setDoesNotThrow();
+
+    IRBuilder builder(
+        BasicBlock::Create(m->getContext(), "entry", reduced_sip_hash_fn));
+    Value *keys[6];
+    for (int i = 0; i < 6; i++)
+        keys[i] = reduced_sip_hash_fn->getArg(i + 1);
+    builder.CreateRet(
+        EmitSipHash(builder, reduced_sip_hash_fn->getArg(0), keys, 1, 2));
+
+    assert(!verifyFunction(*reduced_sip_hash_fn, &errs()) &&
+           "Reduced siphash is broken!");
+
+    return reduced_sip_hash_fn;
+}
+
+Value *EmitSipHash(IRBuilderBase &builder, Value *in, Value *const keys[6],
+                   int c_rounds, int d_rounds)
+{
+    // same steps as HashUtils::SipHash for a single 8 bytes block, keys are
+    // k0, k1, v0, v1, v2, v3 like the ___siphash arguments
+    Value *v0 = builder.CreateXor(keys[2], keys[0]);
+    Value *v1 = builder.CreateXor(keys[3], keys[1]);
+    Value *v2 = builder.CreateXor(keys[4], keys[0]);
+    Value *v3 = builder.CreateXor(keys[5], keys[1]);
+
+    auto rotl = [&](Value *x, uint64_t b)
+    {
+        return builder.CreateOr(builder.CreateShl(x, b),
+                                builder.CreateLShr(x, 64 - b));
+    };
+    auto sip_rounds = [&](int rounds)
+    {
+        for (int i = 0; i < rounds; i++)
+        {
+            v0 = builder.CreateAdd(v0, v1);
+            v1 = builder.CreateXor(rotl(v1, 13), v0);
+            v0 = rotl(v0, 32);
+            v2 = builder.CreateAdd(v2, v3);
+            v3 = builder.CreateXor(rotl(v3, 16), v2);
+            v0 = builder.CreateAdd(v0, v3);
+            v3 = builder.CreateXor(rotl(v3, 21), v0);
+            v2 = builder.CreateAdd(v2, v1);
+            v1 = builder.CreateXor(rotl(v1, 17), v2);
+            v2 = rotl(v2, 32);
+        }
+    };
+
+    // the length block, 8 bytes and no leftover
+    Value *b = builder.getInt64(8ULL << 56);
+
+    v3 = builder.CreateXor(v3, in);
+    sip_rounds(c_rounds);
+    v0 = builder.CreateXor(v0, in);
+
+    v3 = builder.CreateXor(v3, b);
+    sip_rounds(c_rounds);
+    v0 = builder.CreateXor(v0, b);
+
+    v2 = builder.CreateXor(v2, builder.getInt64(0xff));
+    sip_rounds(d_rounds);
+
+    return builder.CreateXor(builder.CreateXor(v0, v1),
+                             builder.CreateXor(v2, v3));
+}
+
+std::pair<int, int>
+SipHashRounds(ControlFlowFlattening::TransformationOptions *options)
+{
+    if (options->SipHashTier == ControlFlowFlattening::SipHashReduced)
+        return {1, 2};
+    return {2, 4};
+}
+
+void DrawSipHashKeys(DispatcherStates &states, uint64_t mask,
+                     ControlFlowFlattening::TransformationOptions *options)
+{
+    auto [c_rounds, d_rounds] = SipHashRounds(options);
+    for (uint64_t &key : states.siphash_keys) // k0, k1, v0, v1, v2, v3
+        key = Random::IntRanged<uint64_t>(0x000F0000, UINT64_MAX);
+
+#define ARG(n) states.siphash_keys[n]
+    states.siphash_counts.clear();
+    for (uint64_t state : states.values)
+    {
+        states.siphash_counts[HashUtils::SipHash(state, ARG(0), ARG(1), ARG(2),
+                                                 ARG(3), ARG(4), ARG(5),
+                                                 c_rounds, d_rounds) &
+                              mask]++;
+    }
+#undef ARG
+
+    states.siphash_batch_left =
+        std::max<size_t>(1, std::sqrt(states.values.size()));
+}
@@ -5,11 +5,14 @@
 #include <llvm/Transforms/Utils/BasicBlockUtils.h>
 #include <map>
 #include <numeric>
+#include <utils/BarrierUtils.h>
 #include <utils/BasicBlockUtils.h>
 #include <utils/CryptoUtils.h>
 #include <utils/FunctionUtils.h>
+#include <utils/HotnessUtils.h>
 #include <utils/Logger.h>
 #include <utils/Random.h>
+#include <utils/ScratchSlots.h>
 
 #define DEBUG_IBR 0
 #define DEBUG_ANDROID 0
@@ -87,8 +90,6 @@ void IndirectBranch::ObfuscateFunction(Function &f, int replace_br_chance)
     if (f.size() < 2)
         return;
 
-    FunctionUtils::FlattenSwitches(f);
-
     int count = std::accumulate(
         f.begin(), f.end(), 0u,
         [](unsigned acc, const BasicBlock &bb)
@@ -155,8 +156,16 @@ void IndirectBranch::ObfuscateFunction(Function &f, int replace_br_chance)
 
     for (BasicBlock &bb : f)
     {
+        // an xtea decryption per hot branch is too expensive
+        if (!BasicBlockUtils::IsInRegion(&bb) || HotnessUtils::IsHot(&bb))
+            continue;
+
         if (BranchInst *branch = llvm::dyn_cast<BranchInst>(bb.getTerminator()))
         {
+            // hot loop back edges stay direct
+            if (HotnessUtils::IsBackEdge(branch))
+                continue;
+
             if (Random::Chance(replace_br_chance))
             {
                 branches.push_back(branch);
@@ -259,15 +268,9 @@ void IndirectBranch::ObfuscateFunction(Function &f, int replace_br_chance)
 
     Type *u32_ty = builder.getInt32Ty();
 
-    builder.SetInsertPoint(f.getEntryBlock().getFirstInsertionPt());
-
-    AllocaInst *var_v0 = builder.CreateAlloca(u32_ty, nullptr, "v0");
-    AllocaInst *var_v1 = builder.CreateAlloca(u32_ty, nullptr, "v1");
-    AllocaInst *var_sum = builder.CreateAlloca(u32_ty, nullptr, "sum");
-    AllocaInst *var_i = builder.CreateAlloca(u32_ty, nullptr, "i");
-
-    AllocaInst *temp_storage =
-        builder.CreateAlloca(u64_ty, nullptr, "xtea_temp");
+    // table contents are patched after linking, the loads go through an
+    // opaque address so they are never folded to the initializer.
+    bool is_volatile = BarrierUtils::VolatileScratch();
 
     for (BranchInst *branch : branches)
     {
@@ -327,13 +330,13 @@ void IndirectBranch::ObfuscateFunction(Function &f, int replace_br_chance)
                     bb_true, "cff.dispatcher_state");
                 cff_state.has_value() && CountBasicBlockUses(bb_true) == 1)
             {
-                Value *load = builder.CreateLoad(
-                    IS_ARM32() ? builder.getInt32Ty() : builder.getInt64Ty(),
-                    std::any_cast<AllocaInst *>(cff_state.value()), true);
+                // 32-bit states may be in use on 64-bit targets too
+                AllocaInst *state =
+                    std::any_cast<AllocaInst *>(cff_state.value());
+                Value *load = builder.CreateLoad(state->getAllocatedType(),
+                                                 state, is_volatile);
                 bb_true_delta =
-                    IS_ARM32()
-                        ? load
-                        : builder.CreateTrunc(load, builder.getInt32Ty());
+                    builder.CreateZExtOrTrunc(load, builder.getInt32Ty());
             }
             else
             {
@@ -344,13 +347,12 @@ void IndirectBranch::ObfuscateFunction(Function &f, int replace_br_chance)
                     bb_false, "cff.dispatcher_state");
                 cff_state.has_value() && CountBasicBlockUses(bb_false) == 1)
             {
-                Value *load = builder.CreateLoad(
-                    IS_ARM32() ? builder.getInt32Ty() : builder.getInt64Ty(),
-                    std::any_cast<AllocaInst *>(cff_state.value()), true);
+                AllocaInst *state =
+                    std::any_cast<AllocaInst *>(cff_state.value());
+                Value *load = builder.CreateLoad(state->getAllocatedType(),
+                                                 state, is_volatile);
                 bb_false_delta =
-                    IS_ARM32()
-                        ? load
-                        : builder.CreateTrunc(load, builder.getInt32Ty());
+                    builder.CreateZExtOrTrunc(load, builder.getInt32Ty());
             }
             else
             {
@@ -389,13 +391,12 @@ void IndirectBranch::ObfuscateFunction(Function &f, int replace_br_chance)
                     BasicBlockUtils::GetMetaData(bb, "cff.dispatcher_state");
                 cff_state.has_value() && CountBasicBlockUses(bb) == 1)
             {
-                Value *load = builder.CreateLoad(
-                    IS_ARM32() ? builder.getInt32Ty() : builder.getInt64Ty(),
-                    std::any_cast<AllocaInst *>(cff_state.value()), true);
+                AllocaInst *state =
+                    std::any_cast<AllocaInst *>(cff_state.value());
+                Value *load = builder.CreateLoad(state->getAllocatedType(),
+                                                 state, is_volatile);
                 xtea_delta =
-                    IS_ARM32()
-                        ? load
-                        : builder.CreateTrunc(load, builder.getInt32Ty());
+                    builder.CreateZExtOrTrunc(load, builder.getInt32Ty());
             }
             else
             {
@@ -420,8 +421,10 @@ void IndirectBranch::ObfuscateFunction(Function &f, int replace_br_chance)
             {builder.getInt32(0), builder.getInt32(array_marker - 1)},
             "seed_ptr"); // seed will host base after our python plugin run
 
-        Value *base_ptr = builder.CreateLoad(block_address_ty, seed_ptr, true,
-                                             "seed_ptr_val");
+        Value *base_ptr =
+            builder.CreateLoad(block_address_ty,
+                               BarrierUtils::Opaque(builder, seed_ptr),
+                               is_volatile, "seed_ptr_val");
 
         Value *base_int = builder.CreatePtrToInt(base_ptr, pint_ty, "seed_val");
 
@@ -431,8 +434,9 @@ void IndirectBranch::ObfuscateFunction(Function &f, int replace_br_chance)
 
         if (IS_ARM32())
         {
-            Value *gep =
-                builder.CreateInBoundsGEP(bb_array_ty, bb_array, indices);
+            Value *gep = BarrierUtils::Opaque(
+                builder,
+                builder.CreateInBoundsGEP(bb_array_ty, bb_array, indices));
 
             // Cast the pointer to a 32-bit integer pointer
             Value *i32_ptr = builder.CreateBitCast(
@@ -440,14 +444,14 @@ void IndirectBranch::ObfuscateFunction(Function &f, int replace_br_chance)
 
             // Load the lower 32 bits
             Value *low32 = builder.CreateLoad(builder.getInt32Ty(), i32_ptr,
-                                              true, "low_part");
+                                              is_volatile, "low_part");
 
             // Get a pointer to the upper 32 bits and load them
             Value *high_ptr =
                 builder.CreateGEP(builder.getInt32Ty(), i32_ptr,
                                   builder.getInt32(1), "high_part_ptr");
             Value *high32 = builder.CreateLoad(builder.getInt32Ty(), high_ptr,
-                                               true, "high_part");
+                                               is_volatile, "high_part");
 
             // Combine into a 64-bit value
             Value *high64 = builder.CreateZExt(high32, builder.getInt64Ty());
@@ -458,13 +462,14 @@ void IndirectBranch::ObfuscateFunction(Function &f, int replace_br_chance)
         }
         else
         {
-            Value *gep = builder.CreateGEP(bb_array_ty, bb_array, indices);
+            Value *gep = BarrierUtils::Opaque(
+                builder, builder.CreateGEP(bb_array_ty, bb_array, indices));
 
             Value *casted_gep =
                 builder.CreateBitCast(gep, PointerType::getUnqual(pint_ty));
 
-            encrypted_value = builder.CreateLoad(pint_ty, casted_gep, true,
-                                                 "encrypted_offset");
+            encrypted_value = builder.CreateLoad(
+                pint_ty, casted_gep, is_volatile, "encrypted_offset");
         }
 
 #if DEBUG_IBR
@@ -483,7 +488,16 @@ void IndirectBranch::ObfuscateFunction(Function &f, int replace_br_chance)
 
 #endif
 
-        builder.CreateStore(encrypted_value, temp_storage, true);
+        // every decipher is done before the indirect branch, so all of them
+        // (over all iterations) run on the same slots.
+        AllocaInst *var_v0 = ScratchSlots::Acquire(builder, u32_ty, "v0");
+        AllocaInst *var_v1 = ScratchSlots::Acquire(builder, u32_ty, "v1");
+        AllocaInst *var_sum = ScratchSlots::Acquire(builder, u32_ty, "sum");
+        AllocaInst *var_i = ScratchSlots::Acquire(builder, u32_ty, "i");
+        AllocaInst *temp_storage =
+            ScratchSlots::Acquire(builder, u64_ty, "xtea_temp");
+
+        builder.CreateStore(encrypted_value, temp_storage, is_volatile);
 
         Value *casted = builder.CreateBitCast(
             temp_storage, PointerType::getUnqual(builder.getInt32Ty()));
@@ -516,8 +530,11 @@ void IndirectBranch::ObfuscateFunction(Function &f, int replace_br_chance)
         CryptoUtils::WriteXTEADecipher(builder, xtea_info, xtea_options, casted,
                                        var_v0, var_v1, var_sum, var_i);
 
-        Value *decrypted_offset =
-            builder.CreateLoad(u64_ty, temp_storage, true, "decrypted_offset");
+        Value *decrypted_offset = builder.CreateLoad(
+            u64_ty, temp_storage, is_volatile, "decrypted_offset");
+
+        for (AllocaInst *slot : {var_v0, var_v1, var_sum, var_i, temp_storage})
+            ScratchSlots::Release(builder, slot);
 
         if (IS_ARM32())
         {
@@ -526,6 +543,8 @@ void IndirectBranch::ObfuscateFunction(Function &f, int replace_br_chance)
             decrypted_offset = builder.CreateZExt(low32, pint_ty);
         }
 
+        decrypted_offset = BarrierUtils::Opaque(builder, decrypted_offset);
+
         DLOG("[DEBUG] Decrypted offset: 0x%lx\n", decrypted_offset);
 
         DLOG("[DEBUG] Runtime base: %p\n", base_ptr);
@@ -554,6 +573,7 @@ void IndirectBranch::ObfuscateFunction(Function &f, int replace_br_chance)
             indir_branch->addDestination(bb);
         }
 
+        BasicBlockUtils::InheritTags(branch, indir_branch);
         branch->replaceAllUsesWith(indir_branch);
         branch->eraseFromParent();
     }
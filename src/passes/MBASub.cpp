@@ -13,6 +13,8 @@
 #include <passes/MBASub.hpp>
 #include <core/ZyroxMetaData.h>
 #include <quickjs/QuickConfig.h>
+#include <utils/BasicBlockUtils.h>
+#include <utils/HotnessUtils.h>
 #include <utils/Random.h>
 
 using namespace llvm;
@@ -39,6 +41,9 @@ void MBASub::ObfuscateFunction(Function &func)
 {
     for (BasicBlock &bb : func)
     {
+        // keep the cheap arithmetic where the profile says it matters
+        if (!BasicBlockUtils::IsInRegion(&bb) || HotnessUtils::IsHot(&bb))
+            continue;
         RunOnBasicBlock(bb);
     }
 }
@@ -201,7 +206,8 @@ Callback or_ops[] = {
                                                                                \
         for (Instruction &Instr : BB)                                          \
         {                                                                      \
-            if (Instr.getOpcode() == Instruction::Op)                          \
+            if (Instr.getOpcode() == Instruction::Op &&                        \
+                !HotnessUtils::IsLoopCarried(&Instr))                          \
                 instructions.push_back(&Instr);                                \
         }                                                                      \
                                                                                \
@@ -5,7 +5,11 @@
 #include <llvm/TargetParser/Triple.h>
 #include <llvm/Transforms/Utils/BasicBlockUtils.h>
 #include <numeric>
+#include <utils/BarrierUtils.h>
+#include <utils/BasicBlockUtils.h>
+#include <utils/HotnessUtils.h>
 #include <utils/Random.h>
+#include <utils/ScratchSlots.h>
 
 void SimpleIndirectBranch::RunOnFunction(Function &f, ZyroxPassOptions *options)
 {
@@ -56,8 +60,14 @@ void SimpleIndirectBranch::ObfuscateFunction(Function &f, int replace_br_chance)
 
     ArrayType *blocks_addresses_array_t = ArrayType::get(pint_ty, 2);
 
-    Value *blocks_addresses_array = builder.CreateAlloca(
-        blocks_addresses_array_t, nullptr, "ibr.blocksAddressesArray");
+    // both addresses are stored right before each indirect branch, every
+    // branch (of every iteration) uses the same table
+    Value *blocks_addresses_array = ScratchSlots::Shared(
+        f, blocks_addresses_array_t, "ibr.blocksAddressesArray");
+
+    // the loaded address is what keeps the branch indirect, only that one
+    // goes through a barrier
+    bool is_volatile = BarrierUtils::VolatileScratch();
 
     bool is_thumb_mode = f.hasFnAttribute("target-features") &&
                          f.getFnAttribute("target-features")
@@ -66,10 +76,14 @@ void SimpleIndirectBranch::ObfuscateFunction(Function &f, int replace_br_chance)
 
     for (BasicBlock &bb : f)
     {
+        if (!BasicBlockUtils::IsInRegion(&bb))
+            continue;
+
         Instruction *term = bb.getTerminator();
         if (auto *branch = dyn_cast<BranchInst>(term))
         {
-            if (!Random::Chance(replace_br_chance))
+            if (HotnessUtils::IsBackEdge(branch) ||
+                !Random::Chance(replace_br_chance))
                 continue;
 
             builder.SetInsertPoint(branch);
@@ -81,7 +95,7 @@ void SimpleIndirectBranch::ObfuscateFunction(Function &f, int replace_br_chance)
                     blocks_addresses_array_t, blocks_addresses_array, indices);
                 builder.CreateStore(BlockAddress::get(branch->getFunction(),
                                                       branch->getSuccessor(i)),
-                                    block_index, true);
+                                    block_index, is_volatile);
             }
 
             Value *index;
@@ -102,7 +116,8 @@ void SimpleIndirectBranch::ObfuscateFunction(Function &f, int replace_br_chance)
             Value *indices[] = {builder.getInt32(0), index};
             Value *gep = builder.CreateGEP(blocks_addresses_array_t,
                                            blocks_addresses_array, indices);
-            Value *load_indirect_addr = builder.CreateLoad(pint_ty, gep, true);
+            Value *load_indirect_addr = BarrierUtils::Opaque(
+                builder, builder.CreateLoad(pint_ty, gep, is_volatile));
 
             if (is_thumb_mode)
             {
@@ -123,6 +138,7 @@ void SimpleIndirectBranch::ObfuscateFunction(Function &f, int replace_br_chance)
                 indir_branch->addDestination(successor);
             }
 
+            BasicBlockUtils::InheritTags(branch, indir_branch);
             branch->replaceAllUsesWith(indir_branch);
             branch->eraseFromParent();
         }
@@ -9,8 +9,11 @@
 #include <quickjs/QuickRt.h>
 #include <string>
 #include <utility>
+#include <utils/BarrierUtils.h>
+#include <utils/HotnessUtils.h>
 #include <utils/Logger.h>
 #include <utils/Random.h>
+#include <utils/ScratchSlots.h>
 #include <vector>
 
 uint32_t SplitMix32(uint32_t &state)
@@ -66,16 +69,6 @@ std::pair<Value *, Value *> BuilderSplitMix32(IRBuilderBase &builder,
     return {new_state, z};
 }
 
-struct DBKVMap
-{
-    AllocaInst *off_var;
-    AllocaInst *state_var;
-    AllocaInst *j_var;
-};
-
-// used to reduce stack allocations per function
-std::unordered_map<std::string, DBKVMap> map;
-
 // ;)
 static void EmitDecryptBuffer(IRBuilderBase &builder, Value *state_seed,
                               Value *in_ptr, Value *out_ptr, Value *str_len)
@@ -86,34 +79,17 @@ static void EmitDecryptBuffer(IRBuilderBase &builder, Value *state_seed,
 
     BasicBlock *entry_bb = builder.GetInsertBlock();
     Function *f = entry_bb->getParent();
-    std::string fn_name = f->getName().str();
 
-    AllocaInst *off_var, *state_var, *j_var;
+    // decryption loops of a function never interleave, they share counters
+    AllocaInst *off_var = ScratchSlots::Shared(*f, i32, "dec.offset.addr");
+    AllocaInst *state_var = ScratchSlots::Shared(*f, i32, "dec.state.addr");
+    AllocaInst *j_var = ScratchSlots::Shared(*f, i32, "dec.j.addr");
 
-    if (!map.contains(fn_name))
-    {
-        IRBuilderBase::InsertPoint save_ip = builder.saveIP();
-        builder.SetInsertPoint(&*f->getEntryBlock().getFirstInsertionPt());
-        off_var = builder.CreateAlloca(i32, nullptr, "dec.offset.addr");
-        state_var = builder.CreateAlloca(i32, nullptr, "dec.state.addr");
-        j_var = builder.CreateAlloca(i32, nullptr, "dec.j.addr");
-        builder.restoreIP(save_ip);
-        map[fn_name] = {
-            .off_var = off_var,
-            .state_var = state_var,
-            .j_var = j_var,
-        };
-    }
-    else
-    {
-        DBKVMap kv = map[fn_name];
-        off_var = kv.off_var;
-        state_var = kv.state_var;
-        j_var = kv.j_var;
-    }
-
-    builder.CreateStore(ConstantInt::get(i32, 0), off_var, true);
-    builder.CreateStore(state_seed, state_var, true);
+    // the seed is all the optimizer would need to decrypt at compile time
+    bool is_volatile = BarrierUtils::VolatileScratch();
+    builder.CreateStore(ConstantInt::get(i32, 0), off_var, is_volatile);
+    builder.CreateStore(BarrierUtils::Opaque(builder, state_seed), state_var,
+                        is_volatile);
 
     BasicBlock *loop_off_bb = BasicBlock::Create(ctx, "dec.loop.off", f);
     BasicBlock *body_off_bb = BasicBlock::Create(ctx, "dec.body.off", f);
@@ -122,9 +98,10 @@ static void EmitDecryptBuffer(IRBuilderBase &builder, Value *state_seed,
     builder.CreateBr(loop_off_bb);
     builder.SetInsertPoint(loop_off_bb);
 
-    Value *current_off = builder.CreateLoad(i32, off_var, true, "dec.offset");
+    Value *current_off =
+        builder.CreateLoad(i32, off_var, is_volatile, "dec.offset");
     Value *current_state =
-        builder.CreateLoad(i32, state_var, true, "dec.state");
+        builder.CreateLoad(i32, state_var, is_volatile, "dec.state");
 
     Value *cmp_off = builder.CreateICmpULT(current_off, str_len, "dec.cmp.off");
     builder.CreateCondBr(cmp_off, body_off_bb, after_off_bb);
@@ -140,11 +117,11 @@ static void EmitDecryptBuffer(IRBuilderBase &builder, Value *state_seed,
     BasicBlock *body_j_bb = BasicBlock::Create(ctx, "dec.body.j", f);
     BasicBlock *after_j_bb = BasicBlock::Create(ctx, "dec.after.j", f);
 
-    builder.CreateStore(ConstantInt::get(i32, 0), j_var, true);
+    builder.CreateStore(ConstantInt::get(i32, 0), j_var, is_volatile);
     builder.CreateBr(loop_j_bb);
 
     builder.SetInsertPoint(loop_j_bb);
-    Value *current_j = builder.CreateLoad(i32, j_var, true, "dec.j");
+    Value *current_j = builder.CreateLoad(i32, j_var, is_volatile, "dec.j");
     Value *cmp_j = builder.CreateICmpULT(current_j, chunk, "dec.cmp.j");
     builder.CreateCondBr(cmp_j, body_j_bb, after_j_bb);
 
@@ -152,7 +129,7 @@ static void EmitDecryptBuffer(IRBuilderBase &builder, Value *state_seed,
     Value *off_plus_j = builder.CreateAdd(current_off, current_j, "dec.off.j");
     Value *in_byte =
         builder.CreateInBoundsGEP(i8, in_ptr, off_plus_j, "dec.in");
-    Value *orig = builder.CreateLoad(i8, in_byte, true, "dec.orig");
+    Value *orig = builder.CreateLoad(i8, in_byte, is_volatile, "dec.orig");
     Value *shift =
         builder.CreateMul(current_j, ConstantInt::get(i32, 8), "j_x_8");
     Value *shift_32 = builder.CreateTrunc(shift, i32, "shift32");
@@ -161,22 +138,192 @@ static void EmitDecryptBuffer(IRBuilderBase &builder, Value *state_seed,
     Value *out = builder.CreateXor(orig, mask, "xor");
     Value *out_byte =
         builder.CreateInBoundsGEP(i8, out_ptr, off_plus_j, "dec.out");
-    builder.CreateStore(out, out_byte, true);
+    builder.CreateStore(out, out_byte, is_volatile);
 
     Value *j_next =
         builder.CreateAdd(current_j, ConstantInt::get(i32, 1), "dec.j.next");
-    builder.CreateStore(j_next, j_var, true);
+    builder.CreateStore(j_next, j_var, is_volatile);
     builder.CreateBr(loop_j_bb);
 
     builder.SetInsertPoint(after_j_bb);
     Value *off_next = builder.CreateAdd(current_off, chunk, "dec.off.next");
-    builder.CreateStore(off_next, off_var, true);
-    builder.CreateStore(new_state, state_var, true);
+    builder.CreateStore(off_next, off_var, is_volatile);
+    builder.CreateStore(new_state, state_var, is_volatile);
     builder.CreateBr(loop_off_bb);
 
     builder.SetInsertPoint(after_off_bb);
 }
 
+struct StringCandidate
+{
+    GlobalVariable *gv;
+    ConstantDataArray *arr;
+    std::string raw;
+    int use_count;
+    bool all_uses_in_functions;
+};
+
+// counts instruction uses of a string global (looking through constant
+// expressions) and whether every one of them lives inside a function.
+static void CollectStringUses(GlobalVariable &gv, int &use_count,
+                              bool &all_uses_in_functions)
+{
+    use_count = 0;
+    all_uses_in_functions = true;
+
+    for (User *user : gv.users())
+    {
+        // ConstantExpr can be used inside instructions
+        if (auto *ce = dyn_cast<ConstantExpr>(user))
+        {
+            for (User *ce_user : ce->users())
+            {
+                auto *inst = dyn_cast<Instruction>(ce_user);
+                if (!inst || !inst->getFunction())
+                    all_uses_in_functions = false;
+                else
+                    use_count++;
+            }
+            continue;
+        }
+
+        auto *inst = dyn_cast<Instruction>(user);
+        if (!inst || !inst->getFunction())
+            all_uses_in_functions = false;
+        else
+            use_count++;
+    }
+}
+
+// a stack copy can't be handed to a musttail call, the callee would read
+// the caller's freed frame
+static bool IsPassedToMustTailCall(GlobalVariable &gv)
+{
+    for (User *user : gv.users())
+    {
+        if (auto *call = dyn_cast<CallInst>(user);
+            call && call->isMustTailCall())
+            return true;
+
+        if (!isa<ConstantExpr>(user))
+            continue;
+
+        for (User *ce_user : user->users())
+        {
+            if (auto *call = dyn_cast<CallInst>(ce_user);
+                call && call->isMustTailCall())
+                return true;
+        }
+    }
+    return false;
+}
+
+// calls that get a pointer into the stack copy read the caller's frame, so
+// they can't stay tail calls
+static void DropTailCallsUsing(Value *ptr)
+{
+    for (User *user : ptr->users())
+    {
+        if (auto *call = dyn_cast<CallInst>(user))
+            call->setTailCallKind(CallInst::TCK_None);
+        else if (isa<GetElementPtrInst>(user) || isa<BitCastInst>(user))
+            DropTailCallsUsing(user);
+    }
+}
+
+static void ReportStringCallbackException(JSContext *js_ctx, const char *name)
+{
+    JSValue exc = JS_GetException(js_ctx);
+    JSValue str = JS_ToString(js_ctx, exc);
+    const char *ptr = JS_ToCString(js_ctx, str);
+    Logger::Error("{} returned an exception: {}", name, ptr);
+}
+
+// JSValue* OnStrings(Strings[])
+// a single call for the whole module, the config gets every candidate with
+// its metadata and returns one mode per string.
+static std::vector<int>
+QueryStringModesBatched(JSValue on_strings,
+                        std::vector<StringCandidate> &candidates)
+{
+    JSValue js_z_this = QuickRt::ConfigClass();
+    JSContext *js_ctx = QuickRt::JSContext();
+
+    JSValue js_strings = JS_NewArray(js_ctx);
+    for (uint32_t i = 0; i < candidates.size(); i++)
+    {
+        StringCandidate &candidate = candidates[i];
+        JSValue js_obj = JS_NewObject(js_ctx);
+        JS_SetPropertyStr(js_ctx, js_obj, "Value",
+                          JS_NewString(js_ctx, candidate.raw.c_str()));
+        JS_SetPropertyStr(
+            js_ctx, js_obj, "Length",
+            JS_NewInt32(js_ctx, candidate.arr->getType()->getNumElements()));
+        JS_SetPropertyStr(js_ctx, js_obj, "UseCount",
+                          JS_NewInt32(js_ctx, candidate.use_count));
+        JS_SetPropertyStr(js_ctx, js_obj, "AllUsesInFunctions",
+                          JS_NewBool(js_ctx, candidate.all_uses_in_functions));
+        JS_SetPropertyUint32(js_ctx, js_strings, i, js_obj);
+    }
+
+    JSValue args[] = {js_strings};
+    JSValue rv = JS_Call(js_ctx, on_strings, js_z_this, 1, args);
+    JS_FreeValue(js_ctx, js_strings);
+
+    std::vector<int> modes(candidates.size(), 0);
+    if (JS_IsUndefined(rv))
+        return modes;
+
+    if (JS_IsException(rv))
+        ReportStringCallbackException(js_ctx, "OnStrings");
+
+    if (!JS_IsArray(js_ctx, rv))
+    {
+        Logger::Warn("OnStrings did not return an array, no string will be "
+                     "encrypted");
+        JS_FreeValue(js_ctx, rv);
+        return modes;
+    }
+
+    for (uint32_t i = 0; i < candidates.size(); i++)
+    {
+        JSValue js_mode = JS_GetPropertyUint32(js_ctx, rv, i);
+        if (!JS_IsUndefined(js_mode))
+            JS_ToInt32(js_ctx, &modes[i], js_mode);
+        JS_FreeValue(js_ctx, js_mode);
+    }
+
+    JS_FreeValue(js_ctx, rv);
+    return modes;
+}
+
+// JSValue* OnString(Str)
+static std::vector<int>
+QueryStringModes(JSValue on_string, std::vector<StringCandidate> &candidates)
+{
+    JSValue js_z_this = QuickRt::ConfigClass();
+    JSContext *js_ctx = QuickRt::JSContext();
+
+    std::vector<int> modes(candidates.size(), 0);
+    for (size_t i = 0; i < candidates.size(); i++)
+    {
+        JSValue js_str = JS_NewString(js_ctx, candidates[i].raw.c_str());
+        JSValue args[] = {js_str};
+        JSValue rv = JS_Call(js_ctx, on_string, js_z_this, 1, args);
+        JS_FreeValue(js_ctx, js_str);
+        if (!JS_IsUndefined(rv))
+        {
+            if (JS_IsException(rv))
+                ReportStringCallbackException(js_ctx, "OnString");
+
+            JS_ToInt32(js_ctx, &modes[i], rv);
+            JS_FreeValue(js_ctx, rv);
+        }
+    }
+
+    return modes;
+}
+
 void StringEncryption::ObfuscateGlobalArrayStrings(Module &m)
 {
     LLVMContext &ctx = m.getContext();
@@ -190,19 +337,20 @@ void StringEncryption::ObfuscateGlobalArrayStrings(Module &m)
 
     std::vector<std::pair<GlobalVariable *, std::string>> stack_list;
 
-    // JSValue* OnString()
-
-    std::optional<JSValue> on_string_v = QuickRt::GetFunction("OnString");
-    if (!on_string_v.has_value())
+    std::optional<JSValue> on_strings_v = QuickRt::GetFunction("OnStrings");
+    std::optional<JSValue> on_string_v;
+    if (!on_strings_v.has_value())
     {
-        Logger::Warn(
-            "OnString function not found, skipping StringEncryption pass");
-        return;
+        on_string_v = QuickRt::GetFunction("OnString");
+        if (!on_string_v.has_value())
+        {
+            Logger::Warn("OnString/OnStrings function not found, skipping "
+                         "StringEncryption pass");
+            return;
+        }
     }
 
-    JSValue on_string = on_string_v.value();
-    JSValue js_z_this = QuickRt::ConfigClass();
-    JSContext *js_ctx = QuickRt::JSContext();
+    std::vector<StringCandidate> candidates;
 
     for (GlobalVariable &gv : m.globals())
     {
@@ -219,80 +367,50 @@ void StringEncryption::ObfuscateGlobalArrayStrings(Module &m)
              StringRef(gv.getSection()).starts_with("llvm")))
             continue;
 
-        std::string raw = arr->getAsString().str();
-        JSValue js_str = JS_NewString(js_ctx, raw.c_str());
-        JSValue args[] = {js_str};
-        JSValue rv = JS_Call(js_ctx, on_string, js_z_this, 1, args);
-        JS_FreeValue(js_ctx, js_str);
-        int option = 0;
-        if (!JS_IsUndefined(rv))
-        {
-            if (JS_IsException(rv))
-            {
-                JSValue exc = JS_GetException(js_ctx);
-                JSValue str = JS_ToString(js_ctx, exc);
-                const char *ptr = JS_ToCString(js_ctx, str);
-                Logger::Error("OnString returned an exception: {}", ptr);
-            }
+        StringCandidate candidate = {
+            .gv = &gv,
+            .arr = arr,
+            .raw = arr->getAsString().str(),
+        };
+        CollectStringUses(gv, candidate.use_count,
+                          candidate.all_uses_in_functions);
+        candidates.push_back(candidate);
+    }
 
-            JS_ToInt32(js_ctx, &option, rv);
-            JS_FreeValue(js_ctx, rv);
-        }
+    std::vector<int> modes;
+    if (on_strings_v.has_value())
+    {
+        modes = QueryStringModesBatched(on_strings_v.value(), candidates);
+        JS_FreeValue(QuickRt::JSContext(), on_strings_v.value());
+    }
+    else
+    {
+        modes = QueryStringModes(on_string_v.value(), candidates);
+        JS_FreeValue(QuickRt::JSContext(), on_string_v.value());
+    }
+
+    for (size_t i = 0; i < candidates.size(); i++)
+    {
+        StringCandidate &candidate = candidates[i];
+        GlobalVariable &gv = *candidate.gv;
+        const std::string &raw = candidate.raw;
+        int option = modes[i];
 
         if (bool starts_by_stack = raw.starts_with("/stack:");
             starts_by_stack || option == 1)
         {
-            bool is_valid = true;
-            for (Use &use : gv.uses())
+            if (!candidate.all_uses_in_functions)
             {
-                Value *user = use.getUser();
-
-                // Unwrap constant expressions
-                while (auto *ce = dyn_cast<ConstantExpr>(user))
-                {
-                    // ConstantExpr can be used inside instructions
-                    for (User *ce_user : ce->users())
-                    {
-                        if (auto *inst = dyn_cast<Instruction>(ce_user))
-                        {
-                            if (!inst->getFunction())
-                            {
-                                is_valid = false;
-                                break;
-                            }
-                        }
-                        else
-                        {
-                            is_valid = false;
-                            break;
-                        }
-                    }
-                    // No instruction uses found
-                    if (!is_valid)
-                        break;
-                    goto next_use;
-                }
-
-                if (auto *inst = dyn_cast<Instruction>(user))
-                {
-                    if (!inst->getFunction())
-                    {
-                        is_valid = false;
-                        break;
-                    }
-                }
-                else
-                {
-                    is_valid = false;
-                    break;
-                }
+                Logger::Warn("string can't be encrypted on stack: '{}', it "
+                             "has uses outside a function",
+                             raw);
 
-            next_use:;
+                continue;
             }
-            if (!is_valid)
+            if (IsPassedToMustTailCall(gv))
             {
                 Logger::Warn("string can't be encrypted on stack: '{}', it "
-                             "has uses outside a function",
+                             "is passed to a musttail call",
                              raw);
 
                 continue;
@@ -301,7 +419,7 @@ void StringEncryption::ObfuscateGlobalArrayStrings(Module &m)
         }
         else if (option == 2)
         {
-            uint64_t str_len = arr->getType()->getNumElements();
+            uint64_t str_len = candidate.arr->getType()->getNumElements();
 
             gv_list.push_back(&gv);
             raw_strings.push_back(raw);
@@ -312,8 +430,6 @@ void StringEncryption::ObfuscateGlobalArrayStrings(Module &m)
         }
     }
 
-    JS_FreeValue(js_ctx, on_string);
-
     if (!gv_list.empty())
     {
         uint32_t master_seed = Random::UInt32();
@@ -344,6 +460,8 @@ void StringEncryption::ObfuscateGlobalArrayStrings(Module &m)
         FunctionType *fn_ty = FunctionType::get(Type::getVoidTy(ctx), false);
         Function *decrypt_fn = Function::Create(
             fn_ty, GlobalValue::InternalLinkage, "__decrypt_ctor", &m);
+        // runs once at startup
+        HotnessUtils::MarkCold(*decrypt_fn);
         BasicBlock *entry = BasicBlock::Create(ctx, "entry", decrypt_fn);
         IRBuilder builder(entry);
 
@@ -401,8 +519,10 @@ void StringEncryption::ObfuscateGlobalArrayStrings(Module &m)
         SimpleIndirectBranch::RegisterFromAnnotation(*decrypt_fn, &args);
     }
 
+    int stack_string_id = 0;
     for (auto [gv, stripped] : stack_list)
     {
+        stack_string_id++;
         Logger::Info("encrypting {} on stack", stripped);
         uint32_t master_seed = Random::UInt32();
 
@@ -450,17 +570,18 @@ void StringEncryption::ObfuscateGlobalArrayStrings(Module &m)
             if (!user_inst || !user_inst->getFunction())
                 continue;
 
-            IRBuilder builder(&*user_inst->getFunction()
-                                    ->getEntryBlock()
-                                    .getFirstInsertionPt());
-
             int size = new_const->getType()->getArrayNumElements();
 
-            AllocaInst *alloca =
-                builder.CreateAlloca(ArrayType::get(Type::getInt8Ty(ctx), size),
-                                     nullptr, "str_stack");
+            // every use of the same string decrypts the same bytes, so they
+            // can share one buffer per function
+            AllocaInst *alloca = ScratchSlots::Shared(
+                *user_inst->getFunction(),
+                ArrayType::get(Type::getInt8Ty(ctx), size),
+                "str_stack." + std::to_string(stack_string_id));
             alloca->setAlignment(Align(4));
 
+            IRBuilder builder(user_inst);
+
             builder.SetInsertPoint(user_inst);
             BasicBlock *original = user_inst->getParent();
             BasicBlock *split = original->splitBasicBlock(user_inst);
@@ -485,6 +606,7 @@ void StringEncryption::ObfuscateGlobalArrayStrings(Module &m)
             term->eraseFromParent();
 
             use_ptr->set(first_elem);
+            DropTailCallsUsing(first_elem);
         }
         gv->eraseFromParent();
     }
@@ -1,3 +1,4 @@
+#include <core/ZyroxModuleOptions.h>
 #include <core/ZyroxPassOptions.h>
 #include <cstdio>
 #include <fstream>
@@ -18,12 +19,14 @@ ZJS_FUNC(RegisterClass);
 ZJS_FUNC(log);
 ZJS_FUNC(RegisterPass);
 ZJS_FUNC(AddMetaData);
+ZJS_FUNC(SetOption);
 
 const JSCFunctionListEntry zjs_funcs[] = {
     JS_CPPFUNC_DEF("RegisterClass", 1, ZJS_RegisterClass),
     JS_CPPFUNC_DEF("log", 1, ZJS_log),
     JS_CPPFUNC_DEF("RegisterPass", 1, ZJS_RegisterPass),
     JS_CPPFUNC_DEF("AddMetaData", 1, ZJS_AddMetaData),
+    JS_CPPFUNC_DEF("SetOption", 2, ZJS_SetOption),
 };
 
 const JSCFunctionListEntry zjs_obj[] = {
@@ -58,6 +61,10 @@ std::optional<JSValue> QuickRt::GetFunction(const char *name)
 
 void QuickRt::InitZyroxRuntime()
 {
+    // already up from the pin pass of this module
+    if (ctx != nullptr)
+        return;
+
     rt = JS_NewRuntime();
     ctx = JS_NewContext(rt);
 
@@ -232,6 +239,42 @@ ZJS_FUNC(AddMetaData)
     return JS_UNDEFINED;
 }
 
+ZJS_FUNC(SetOption)
+{
+    ZJS_CHECK_ARGC(2);
+
+    JSValue name = argv[0];
+    if (JS_VALUE_GET_TAG(name) != JS_TAG_STRING)
+    {
+        return JS_ThrowTypeError(ctx, "expected option name to be a string");
+    }
+
+    const char *c_str = JS_ToCString(ctx, name);
+
+    if (JS_VALUE_GET_TAG(argv[1]) == JS_TAG_STRING)
+    {
+        const char *value = JS_ToCString(ctx, argv[1]);
+        ZyroxModuleOptions::SetString(c_str, value);
+        JS_FreeCString(ctx, value);
+        JS_FreeCString(ctx, c_str);
+        return JS_UNDEFINED;
+    }
+
+    int32_t value;
+    if (JS_ToInt32(ctx, &value, argv[1]))
+    {
+        JS_FreeCString(ctx, c_str);
+        return JS_ThrowTypeError(ctx,
+                                 "expected option value to be a number or a "
+                                 "string");
+    }
+
+    ZyroxModuleOptions::Set(c_str, value);
+    JS_FreeCString(ctx, c_str);
+
+    return JS_UNDEFINED;
+}
+
 ZJS_FUNC(log)
 {
     const char *str;
@@ -262,4 +305,6 @@ void QuickRt::DestroyInstance()
     JS_FreeValue(ctx, config_class);
     JS_FreeContext(ctx);
     JS_FreeRuntime(rt);
+    ctx = nullptr;
+    rt = nullptr;
 }
@@ -0,0 +1,29 @@
+#include <core/ZyroxModuleOptions.h>
+#include <llvm/IR/InlineAsm.h>
+#include <utils/BarrierUtils.h>
+
+bool BarrierUtils::VolatileScratch()
+{
+    return ZyroxModuleOptions::Get("Barrier.Mode") != 1;
+}
+
+Value *BarrierUtils::Opaque(IRBuilderBase &builder, Value *v)
+{
+    if (VolatileScratch())
+        return v;
+
+    // the output is tied to the input register, no instruction is emitted
+    Type *ty = v->getType();
+    InlineAsm *barrier = InlineAsm::get(FunctionType::get(ty, {ty}, false), "",
+                                        "=r,0", false);
+    return builder.CreateCall(barrier, {v});
+}
+
+Value *BarrierUtils::StripOpaque(Value *v)
+{
+    if (auto *call = dyn_cast<CallInst>(v);
+        call && call->isInlineAsm() && call->arg_size() == 1 &&
+        cast<InlineAsm>(call->getCalledOperand())->getAsmString().empty())
+        return call->getArgOperand(0);
+    return v;
+}
@@ -1,7 +1,11 @@
+#include <llvm/IR/CFG.h>
 #include <llvm/IR/IRBuilder.h>
 #include <llvm/IR/Instruction.h>
+#include <llvm/IR/Instructions.h>
+#include <set>
 #include <utils/BasicBlockUtils.h>
 #include <utils/Logger.h>
+#include <utils/ScratchSlots.h>
 
 void BasicBlockUtils::FlattenSwitch(BasicBlock *bb)
 {
@@ -27,14 +31,20 @@ void BasicBlockUtils::FlattenSwitch(BasicBlock *bb)
             BasicBlock::Create(ctx, "switch.case." + std::to_string(i), f));
     }
 
-    IRBuilder builder(&*bb->getParent()->getEntryBlock().getFirstInsertionPt());
+    // a compare chain is done before any other switch starts, they all go
+    // through one slot per condition type
     Value *switch_cond = switch_inst->getCondition();
     AllocaInst *switch_cond_val =
-        builder.CreateAlloca(switch_cond->getType(), nullptr, "switch.cond");
+        ScratchSlots::Shared(*f, switch_cond->getType(), "switch.cond");
 
-    builder.SetInsertPoint(switch_inst);
+    IRBuilder builder(switch_inst);
     builder.CreateStore(switch_cond, switch_cond_val);
-    terminator->replaceAllUsesWith(builder.CreateBr(b_bs.front()));
+    Instruction *br = builder.CreateBr(b_bs.front());
+    InheritTags(terminator, br);
+    terminator->replaceAllUsesWith(br);
+
+    // (compare block, successor) for every new edge, used to fix phi nodes
+    std::vector<std::pair<BasicBlock *, BasicBlock *>> edges;
 
     i = 0;
     for (const SwitchInst::CaseHandle &case_handle : switch_inst->cases())
@@ -45,6 +55,7 @@ void BasicBlockUtils::FlattenSwitch(BasicBlock *bb)
             switch_cond->getType(), switch_cond_val, "switch.cond.val");
         Value *cmp =
             builder.CreateICmpEQ(state_val, case_handle.getCaseValue());
+        edges.push_back({case_cmp_block, case_handle.getCaseSuccessor()});
         if (i != b_bs.size())
         {
             // go to next case check
@@ -54,6 +65,34 @@ void BasicBlockUtils::FlattenSwitch(BasicBlock *bb)
         {
             builder.CreateCondBr(cmp, case_handle.getCaseSuccessor(),
                                  switch_inst->getDefaultDest());
+            edges.push_back({case_cmp_block, switch_inst->getDefaultDest()});
+        }
+    }
+
+    for (BasicBlock *case_cmp_block : b_bs)
+    {
+        for (Instruction &inst : *case_cmp_block)
+            InheritTags(terminator, &inst);
+    }
+
+    // successors are now reached from the compare blocks instead of bb, phi
+    // nodes are kept so the switch can be flattened without demoting them.
+    std::set<BasicBlock *> successors(succ_begin(switch_inst),
+                                      succ_end(switch_inst));
+    for (BasicBlock *successor : successors)
+    {
+        for (PHINode &phi : successor->phis())
+        {
+            Value *incoming = phi.getIncomingValueForBlock(bb);
+            while (phi.getBasicBlockIndex(bb) != -1)
+            {
+                phi.removeIncomingValue(bb, false);
+            }
+            for (auto &[from, to] : edges)
+            {
+                if (to == successor)
+                    phi.addIncoming(incoming, from);
+            }
         }
     }
 
@@ -82,3 +121,80 @@ std::optional<std::any> BasicBlockUtils::GetMetaData(BasicBlock *bb,
 }
 
 void BasicBlockUtils::RemoveMetaData(BasicBlock *bb) { meta_map.erase(bb); }
+
+std::set<std::string> known_tags;
+
+void BasicBlockUtils::Tag(BasicBlock *bb, StringRef tag)
+{
+    for (Instruction &i : *bb)
+    {
+        Tag(&i, tag);
+    }
+}
+
+void BasicBlockUtils::Tag(Instruction *i, StringRef tag)
+{
+    known_tags.insert(tag.str());
+    i->setMetadata(tag, MDNode::get(i->getContext(), {}));
+}
+
+bool BasicBlockUtils::HasTag(BasicBlock *bb, StringRef tag)
+{
+    for (Instruction &i : *bb)
+    {
+        if (i.getMetadata(tag))
+            return true;
+    }
+    return false;
+}
+
+bool BasicBlockUtils::HasTag(Instruction *i, StringRef tag)
+{
+    return i->getMetadata(tag) != nullptr;
+}
+
+void BasicBlockUtils::InheritTags(Instruction *from, Instruction *to)
+{
+    for (const std::string &tag : known_tags)
+    {
+        if (MDNode *n = from->getMetadata(tag))
+            to->setMetadata(tag, n);
+    }
+}
+
+void BasicBlockUtils::StripTags(Function &f)
+{
+    for (BasicBlock &bb : f)
+    {
+        for (Instruction &i : bb)
+        {
+            for (const std::string &tag : known_tags)
+                i.setMetadata(tag, nullptr);
+        }
+    }
+    f.setMetadata("zyrox.regions", nullptr);
+    f.setMetadata("zyrox.hotness", nullptr);
+}
+
+bool BasicBlockUtils::IsInRegion(BasicBlock *bb)
+{
+    if (!bb->getParent()->hasMetadata("zyrox.regions"))
+        return true;
+    return HasTag(bb, "zyrox.region");
+}
+
+CallInst *BasicBlockUtils::GetTailCall(BasicBlock *bb)
+{
+    auto *ret = dyn_cast<ReturnInst>(bb->getTerminator());
+    if (!ret)
+        return nullptr;
+
+    Instruction *prev = ret->getPrevNode();
+    if (prev && isa<BitCastInst>(prev))
+        prev = prev->getPrevNode();
+
+    auto *call = dyn_cast_or_null<CallInst>(prev);
+    if (!call || !call->isTailCall())
+        return nullptr;
+    return call;
+}
@@ -1,8 +1,17 @@
+#include <core/ZyroxAnalysis.h>
+#include <core/ZyroxModuleOptions.h>
+#include <llvm/IR/CFG.h>
+#include <llvm/IR/IRBuilder.h>
 #include <llvm/IR/Instructions.h>
+#include <llvm/Transforms/Utils/BasicBlockUtils.h>
 #include <llvm/Transforms/Utils/Local.h>
+#include <llvm/Transforms/Utils/PromoteMemToReg.h>
 #include <random>
+#include <set>
+#include <utils/BarrierUtils.h>
 #include <utils/BasicBlockUtils.h>
 #include <utils/FunctionUtils.h>
+#include <utils/HotnessUtils.h>
 
 bool FunctionUtils::HasCXXExceptions(Function &f)
 {
@@ -18,11 +27,19 @@ bool FunctionUtils::HasCXXExceptions(Function &f)
     return false;
 }
 
+void ShuffleBlockChains(Function &f);
+
 void FunctionUtils::ShuffleBlocks(Function &f)
 {
     if (f.empty())
         return;
 
+    if (ZyroxModuleOptions::Get("BlockLayout.Mode") == 1)
+    {
+        ShuffleBlockChains(f);
+        return;
+    }
+
     std::vector<BasicBlock *> b_bs;
     BasicBlock &entry = f.getEntryBlock();
 
@@ -51,6 +68,72 @@ void FunctionUtils::ShuffleBlocks(Function &f)
     }
 }
 
+// likely fallthrough chains (by BranchProbabilityInfo, which uses !prof when
+// there is a profile) are kept contiguous, only whole chains and cold blocks
+// are shuffled.
+void ShuffleBlockChains(Function &f)
+{
+    // callers shuffle right after changing the cfg
+    ZyroxAnalysis::Invalidate(f, PreservedAnalyses::none());
+    BranchProbabilityInfo &bpi = ZyroxAnalysis::GetBranchProbability(f);
+
+    const BranchProbability likely(1, 2);
+
+    std::set<BasicBlock *> placed;
+    std::vector<std::vector<BasicBlock *>> chains;
+
+    for (BasicBlock &bb : f)
+    {
+        if (placed.contains(&bb))
+            continue;
+
+        std::vector<BasicBlock *> chain;
+        BasicBlock *current = &bb;
+        while (current)
+        {
+            chain.push_back(current);
+            placed.insert(current);
+
+            BasicBlock *next = nullptr;
+            if (!HotnessUtils::IsCold(current))
+            {
+                for (BasicBlock *successor : successors(current))
+                {
+                    if (placed.contains(successor) ||
+                        successor->isEntryBlock() ||
+                        HotnessUtils::IsCold(successor))
+                        continue;
+
+                    if (bpi.getEdgeProbability(current, successor) > likely)
+                    {
+                        next = successor;
+                        break;
+                    }
+                }
+            }
+            current = next;
+        }
+
+        chains.push_back(chain);
+    }
+
+    // first chain starts at the entry block and stays first
+    std::random_device rd;
+    std::mt19937 g(rd());
+    std::shuffle(chains.begin() + 1, chains.end(), g);
+
+    BasicBlock *insert_point = nullptr;
+    for (std::vector<BasicBlock *> &chain : chains)
+    {
+        for (BasicBlock *bb : chain)
+        {
+            if (insert_point)
+                bb->moveAfter(insert_point);
+            insert_point = bb;
+        }
+    }
+}
+
 void FunctionUtils::DemotePHIToStack(Function &f)
 {
     std::vector<PHINode *> phi_nodes;
@@ -68,14 +151,14 @@ void FunctionUtils::DemotePHIToStack(Function &f)
 
     for (PHINode *phi : phi_nodes)
     {
-        llvm::DemotePHIToStack(phi, nullptr);
+        if (AllocaInst *slot = llvm::DemotePHIToStack(phi, nullptr))
+            BasicBlockUtils::Tag(slot, "zyrox.demoted");
     }
 }
 
 void FunctionUtils::DemoteRegToStack(Function &f)
 {
-    DominatorTree dt;
-    dt.recalculate(f);
+    DominatorTree &dt = ZyroxAnalysis::GetDomTree(f);
     std::vector<Instruction *> to_demote;
     for (BasicBlock &bb : f)
     {
@@ -84,6 +167,10 @@ void FunctionUtils::DemoteRegToStack(Function &f)
             if (i.getType()->isVoidTy() || isa<AllocaInst>(i) ||
                 i.isTerminator())
                 continue;
+            // a musttail result can only feed its ret
+            if (auto *call = dyn_cast<CallInst>(&i);
+                call && call->isMustTailCall())
+                continue;
             for (User *u : i.users())
             {
                 if (Instruction *ui = dyn_cast<Instruction>(u))
@@ -99,7 +186,134 @@ void FunctionUtils::DemoteRegToStack(Function &f)
     }
     for (Instruction *i : to_demote)
     {
-        llvm::DemoteRegToStack(*i, false);
+        if (AllocaInst *slot = llvm::DemoteRegToStack(*i, false))
+            BasicBlockUtils::Tag(slot, "zyrox.demoted");
+    }
+}
+
+void FoldStateTrampolines(Function &f);
+
+void RemoveForwardingBlocks(Function &f);
+
+void FunctionUtils::Cleanup(Function &f)
+{
+    FoldStateTrampolines(f);
+    RemoveForwardingBlocks(f);
+    ZyroxAnalysis::Invalidate(f, PreservedAnalyses::none());
+
+    // only demoted values are promoted, the dispatcher state and the
+    // indirect branch tables stay in memory (or behind barriers) so the
+    // flattened edges stay hidden.
+    std::vector<AllocaInst *> slots;
+    for (Instruction &i : f.getEntryBlock())
+    {
+        if (auto *slot = dyn_cast<AllocaInst>(&i);
+            slot && BasicBlockUtils::HasTag(slot, "zyrox.demoted") &&
+            isAllocaPromotable(slot))
+            slots.push_back(slot);
+    }
+
+    if (slots.empty())
+        return;
+
+    PromoteMemToReg(slots, ZyroxAnalysis::GetDomTree(f));
+
+    PreservedAnalyses pa;
+    pa.preserveSet<CFGAnalyses>();
+    ZyroxAnalysis::Invalidate(f, pa);
+}
+
+// `store <const>, %state; br %dispatch` (the constant possibly behind a
+// barrier) with a single predecessor, as left behind by
+// ControlFlowFlattening for conditional branches.
+StoreInst *AsStateTrampoline(BasicBlock *bb)
+{
+    if (!BasicBlockUtils::HasTag(bb, "zyrox.created") ||
+        !bb->getSinglePredecessor())
+        return nullptr;
+
+    auto *br = dyn_cast<BranchInst>(bb->getTerminator());
+    if (!br || br->isConditional())
+        return nullptr;
+
+    auto *store = dyn_cast_or_null<StoreInst>(br->getPrevNode());
+    if (!store)
+        return nullptr;
+
+    Value *state = store->getValueOperand();
+    Value *constant = BarrierUtils::StripOpaque(state);
+    if (!isa<Constant>(constant))
+        return nullptr;
+
+    if (constant == state)
+        return bb->size() == 2 ? store : nullptr;
+
+    auto *barrier = cast<Instruction>(state);
+    return bb->size() == 3 && barrier->getParent() == bb ? store : nullptr;
+}
+
+// br %c, %true_state, %false_state becomes a select of the two states, the
+// dispatcher still decides where to go.
+void FoldStateTrampolines(Function &f)
+{
+    std::vector<BranchInst *> branches;
+    for (BasicBlock &bb : f)
+    {
+        auto *br = dyn_cast<BranchInst>(bb.getTerminator());
+        if (br && br->isConditional())
+            branches.push_back(br);
+    }
+
+    for (BranchInst *br : branches)
+    {
+        StoreInst *true_store = AsStateTrampoline(br->getSuccessor(0));
+        StoreInst *false_store = AsStateTrampoline(br->getSuccessor(1));
+        if (!true_store || !false_store ||
+            true_store->getPointerOperand() != false_store->getPointerOperand())
+            continue;
+
+        BasicBlock *true_state = true_store->getParent();
+        BasicBlock *false_state = false_store->getParent();
+        BasicBlock *dispatch = true_state->getSingleSuccessor();
+        if (false_state->getSingleSuccessor() != dispatch ||
+            !dispatch->phis().empty())
+            continue;
+
+        IRBuilder<> builder(br);
+        Value *state = builder.CreateSelect(
+            br->getCondition(),
+            BarrierUtils::StripOpaque(true_store->getValueOperand()),
+            BarrierUtils::StripOpaque(false_store->getValueOperand()));
+        builder.CreateStore(BarrierUtils::Opaque(builder, state),
+                            true_store->getPointerOperand(),
+                            true_store->isVolatile());
+        Instruction *new_br = builder.CreateBr(dispatch);
+        BasicBlockUtils::InheritTags(br, new_br);
+
+        br->eraseFromParent();
+        true_state->eraseFromParent();
+        false_state->eraseFromParent();
+    }
+}
+
+// zyrox blocks holding nothing but an unconditional branch (the dispatcher
+// head, the default case), their predecessors jump to the target directly.
+void RemoveForwardingBlocks(Function &f)
+{
+    std::vector<BasicBlock *> forwarders;
+    for (BasicBlock &bb : f)
+    {
+        auto *br = dyn_cast<BranchInst>(bb.getTerminator());
+        if (bb.isEntryBlock() || bb.size() != 1 || !br ||
+            br->isConditional() || bb.hasAddressTaken() ||
+            !BasicBlockUtils::HasTag(&bb, "zyrox.created"))
+            continue;
+        forwarders.push_back(&bb);
+    }
+
+    for (BasicBlock *bb : forwarders)
+    {
+        TryToSimplifyUncondBranchFromEmptyBlock(bb);
     }
 }
 
@@ -107,13 +321,78 @@ void FunctionUtils::FlattenSwitches(Function &f)
 {
     for (BasicBlock &bb : f)
     {
-        if (isa<SwitchInst>(bb.getTerminator()))
+        // a cff jump table dispatcher is a switch on purpose, passes that
+        // require no switches only rewrite branches and leave it alone
+        auto *sw = dyn_cast<SwitchInst>(bb.getTerminator());
+        if (sw && !BasicBlockUtils::HasTag(sw, "zyrox.dispatch"))
         {
             BasicBlockUtils::FlattenSwitch(&bb);
         }
     }
 }
 
+// the exit block of a tail call: phi nodes (only the returned one used) and
+// a ret of the call result
+bool ReturnsTailCall(BranchInst *br, CallInst *call)
+{
+    BasicBlock *exit = br->getSuccessor(0);
+    auto *ret = dyn_cast<ReturnInst>(exit->getTerminator());
+    if (!ret || exit->getFirstNonPHI() != ret)
+        return false;
+
+    Value *ret_val = ret->getReturnValue();
+    if (!ret_val)
+        return exit->phis().empty();
+
+    auto *phi = dyn_cast<PHINode>(ret_val);
+    if (!phi || phi->getParent() != exit)
+        return ret_val == call;
+
+    return std::distance(exit->phis().begin(), exit->phis().end()) == 1 &&
+           phi->getIncomingValueForBlock(br->getParent()) == call;
+}
+
+bool FunctionUtils::DuplicateTailReturns(Function &f)
+{
+    std::vector<BranchInst *> branches;
+    for (BasicBlock &bb : f)
+    {
+        auto *br = dyn_cast<BranchInst>(bb.getTerminator());
+        if (!br || br->isConditional())
+            continue;
+
+        auto *call = dyn_cast_or_null<CallInst>(br->getPrevNode());
+        if (call && call->isTailCall() && ReturnsTailCall(br, call))
+            branches.push_back(br);
+    }
+
+    std::set<BasicBlock *> exits;
+    for (BranchInst *br : branches)
+    {
+        BasicBlock *bb = br->getParent();
+        BasicBlock *exit = br->getSuccessor(0);
+        auto *call = cast<CallInst>(br->getPrevNode());
+
+        // a void function may drop the result of a non-void callee, only a
+        // non-void function returns the call (ReturnsTailCall checked that)
+        Value *ret_val = f.getReturnType()->isVoidTy() ? nullptr : call;
+        ReturnInst *ret = ReturnInst::Create(f.getContext(), ret_val, br);
+        BasicBlockUtils::InheritTags(br, ret);
+
+        exit->removePredecessor(bb);
+        br->eraseFromParent();
+        exits.insert(exit);
+    }
+
+    for (BasicBlock *exit : exits)
+    {
+        if (pred_empty(exit))
+            DeleteDeadBlock(exit);
+    }
+
+    return !branches.empty();
+}
+
 void FunctionUtils::EnsureAllocasInEntryBlocks(Function &f)
 {
     Instruction *first_instruction = &*f.getEntryBlock().begin();
@@ -138,3 +417,76 @@ void FunctionUtils::EnsureAllocasInEntryBlocks(Function &f)
         ai->moveBefore(first_instruction);
     }
 }
+
+bool IsRegionMarker(Instruction &i, StringRef marker_name)
+{
+    if (auto *call = dyn_cast<CallInst>(&i))
+    {
+        Function *callee = call->getCalledFunction();
+        return callee && callee->getName() == marker_name;
+    }
+    return false;
+}
+
+bool FunctionUtils::MarkRegions(Function &f)
+{
+    std::vector<Instruction *> begin_markers;
+    std::vector<Instruction *> end_markers;
+
+    for (BasicBlock &bb : f)
+    {
+        for (Instruction &i : bb)
+        {
+            if (IsRegionMarker(i, "__zyrox_region_begin"))
+                begin_markers.push_back(&i);
+            else if (IsRegionMarker(i, "__zyrox_region_end"))
+                end_markers.push_back(&i);
+        }
+    }
+
+    if (begin_markers.empty() && end_markers.empty())
+        return false;
+
+    // every end marker starts a block the region walk stops at
+    std::set<BasicBlock *> exits;
+    for (Instruction *marker : end_markers)
+    {
+        BasicBlock *exit = marker->getParent()->splitBasicBlock(marker);
+        marker->eraseFromParent();
+        exits.insert(exit);
+    }
+
+    std::vector<BasicBlock *> work_list;
+    for (Instruction *marker : begin_markers)
+    {
+        BasicBlock *start =
+            marker->getParent()->splitBasicBlock(marker->getNextNode());
+        marker->eraseFromParent();
+        work_list.push_back(start);
+    }
+
+    std::set<BasicBlock *> region;
+    while (!work_list.empty())
+    {
+        BasicBlock *bb = work_list.back();
+        work_list.pop_back();
+
+        if (exits.contains(bb) || bb->isEntryBlock() || region.contains(bb))
+            continue;
+
+        region.insert(bb);
+        for (BasicBlock *successor : successors(bb))
+        {
+            work_list.push_back(successor);
+        }
+    }
+
+    for (BasicBlock *bb : region)
+    {
+        BasicBlockUtils::Tag(bb, "zyrox.region");
+    }
+
+    f.setMetadata("zyrox.regions", MDNode::get(f.getContext(), {}));
+
+    return true;
+}
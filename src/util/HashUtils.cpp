@@ -20,13 +20,6 @@
    <http://creativecommons.org/publicdomain/zero/1.0/>.
  */
 
-#ifndef cROUNDS
-#define cROUNDS 2
-#endif
-#ifndef dROUNDS
-#define dROUNDS 4
-#endif
-
 #define ROTL(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
 
 #define U32TO8_LE(p, v)                                                        \
@@ -86,9 +79,11 @@
     *k: pointer to the key data (read-only), must be 16 bytes
     *out: pointer to output data (write-only), outlen bytes must be allocated
     outlen: length of the output in bytes, must be 8 or 16
+    c_rounds/d_rounds: compression/finalization rounds, 2-4 is the reference
 */
 uint64_t HashUtils::SipHash(uint64_t in, uint64_t k0, uint64_t k1, uint64_t v0,
-                            uint64_t v1, uint64_t v2, uint64_t v3)
+                            uint64_t v1, uint64_t v2, uint64_t v3,
+                            int c_rounds, int d_rounds)
 {
 
     uint64_t out_value = 0;
@@ -125,7 +120,7 @@ uint64_t HashUtils::SipHash(uint64_t in, uint64_t k0, uint64_t k1, uint64_t v0,
         v3 ^= m;
 
         TRACE;
-        for (i = 0; i < cROUNDS; ++i)
+        for (i = 0; i < c_rounds; ++i)
             SIPROUND;
 
         v0 ^= m;
@@ -163,7 +158,7 @@ uint64_t HashUtils::SipHash(uint64_t in, uint64_t k0, uint64_t k1, uint64_t v0,
     v3 ^= b;
 
     TRACE;
-    for (i = 0; i < cROUNDS; ++i)
+    for (i = 0; i < c_rounds; ++i)
         SIPROUND;
 
     v0 ^= b;
@@ -174,7 +169,7 @@ uint64_t HashUtils::SipHash(uint64_t in, uint64_t k0, uint64_t k1, uint64_t v0,
     v2 ^= 0xff;
 
     TRACE;
-    for (i = 0; i < dROUNDS; ++i)
+    for (i = 0; i < d_rounds; ++i)
         SIPROUND;
 
     b = v0 ^ v1 ^ v2 ^ v3;
@@ -186,7 +181,7 @@ uint64_t HashUtils::SipHash(uint64_t in, uint64_t k0, uint64_t k1, uint64_t v0,
     // v1 ^= 0xdd;
     //
     // TRACE;
-    // for (i = 0; i < dROUNDS; ++i)
+    // for (i = 0; i < d_rounds; ++i)
     //     SIPROUND;
     //
     // b = v0 ^ v1 ^ v2 ^ v3;
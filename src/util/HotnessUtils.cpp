@@ -0,0 +1,203 @@
+#include <core/ZyroxAnalysis.h>
+#include <core/ZyroxModuleOptions.h>
+#include <llvm/Analysis/LoopInfo.h>
+#include <llvm/Analysis/ProfileSummaryInfo.h>
+#include <llvm/Demangle/Demangle.h>
+#include <llvm/Transforms/Instrumentation/PGOInstrumentation.h>
+#include <utils/BasicBlockUtils.h>
+#include <utils/HotnessUtils.h>
+#include <utils/Logger.h>
+
+void HotnessUtils::LoadProfile(Module &m, ModuleAnalysisManager &mam)
+{
+    std::string profile_file = ZyroxModuleOptions::GetString("Profile.File");
+    if (profile_file.empty())
+        return;
+
+    if (m.getProfileSummary(false))
+    {
+        Logger::Info("module already has a profile, ignoring {}",
+                     profile_file);
+        return;
+    }
+
+    Logger::Info("loading profile {}", profile_file);
+    PreservedAnalyses pa = PGOInstrumentationUse(profile_file).run(m, mam);
+    mam.invalidate(m, pa);
+}
+
+void TagProfileBlocks(Function &f);
+
+void TagHotLoops(Function &f, int threshold);
+
+void HotnessUtils::TagBlocks(Function &f)
+{
+    if (f.hasMetadata("zyrox.hotness"))
+        return;
+
+    f.setMetadata("zyrox.hotness", MDNode::get(f.getContext(), {}));
+
+    TagProfileBlocks(f);
+
+    if (int threshold = ZyroxModuleOptions::Get("Hotness.Threshold");
+        threshold > 0)
+    {
+        TagHotLoops(f, threshold);
+    }
+}
+
+void TagProfileBlocks(Function &f)
+{
+    ProfileSummaryInfo *psi = ZyroxAnalysis::GetProfileSummary();
+    if (!psi || !psi->hasProfileSummary() || !f.getEntryCount())
+        return;
+
+    // percentiles in parts per million, same as llvm's
+    // -profile-summary-cutoff-hot/cold
+    int hot_cutoff = ZyroxModuleOptions::Get("Profile.HotCutoff", 990000);
+    int cold_cutoff = ZyroxModuleOptions::Get("Profile.ColdCutoff", 999999);
+
+    BlockFrequencyInfo &bfi = ZyroxAnalysis::GetBlockFrequency(f);
+
+    int hot_count = 0;
+    int cold_count = 0;
+    for (BasicBlock &bb : f)
+    {
+        if (psi->isHotBlockNthPercentile(hot_cutoff, &bb, &bfi))
+        {
+            BasicBlockUtils::Tag(&bb, "zyrox.hot");
+            hot_count++;
+        }
+        else if (psi->isColdBlockNthPercentile(cold_cutoff, &bb, &bfi))
+        {
+            BasicBlockUtils::Tag(&bb, "zyrox.cold");
+            cold_count++;
+        }
+    }
+
+    Logger::Info("{}: {} hot and {} cold blocks out of {}",
+                 demangle(f.getName()), hot_count, cold_count, f.size());
+}
+
+// a loop is hot if its header runs at least `threshold` times per call of f
+// (by BFI, static or from the profile). hot functions have every loop hot and
+// cold functions none.
+void TagHotLoops(Function &f, int threshold)
+{
+    if (f.hasFnAttribute(Attribute::Cold))
+    {
+        for (BasicBlock &bb : f)
+        {
+            if (!HotnessUtils::IsHot(&bb))
+                BasicBlockUtils::Tag(&bb, "zyrox.cold");
+        }
+        return;
+    }
+
+    // innermost loops with at most this many blocks are "tight"
+    constexpr unsigned tight_loop_max_blocks = 4;
+
+    bool is_hot_function = f.hasFnAttribute(Attribute::Hot);
+
+    LoopInfo &li = ZyroxAnalysis::GetLoopInfo(f);
+    BlockFrequencyInfo &bfi = ZyroxAnalysis::GetBlockFrequency(f);
+    uint64_t entry_freq = bfi.getBlockFreq(&f.getEntryBlock()).getFrequency();
+
+    int hot_loops = 0;
+    for (Loop *loop : li.getLoopsInPreorder())
+    {
+        uint64_t header_freq =
+            bfi.getBlockFreq(loop->getHeader()).getFrequency();
+        if (!is_hot_function && header_freq < entry_freq * threshold)
+            continue;
+
+        hot_loops++;
+
+        SmallVector<BasicBlock *, 4> latches;
+        loop->getLoopLatches(latches);
+        for (BasicBlock *latch : latches)
+        {
+            BasicBlockUtils::Tag(latch->getTerminator(), "zyrox.loop.backedge");
+        }
+
+        for (PHINode &phi : loop->getHeader()->phis())
+        {
+            for (Value *incoming : phi.incoming_values())
+            {
+                auto *op = dyn_cast<BinaryOperator>(incoming);
+                if (op && loop->contains(op))
+                    BasicBlockUtils::Tag(op, "zyrox.loop.carried");
+            }
+        }
+
+        if (!loop->isInnermost())
+            continue;
+
+        for (BasicBlock *bb : loop->blocks())
+        {
+            BasicBlockUtils::Tag(bb, "zyrox.loop.inner");
+            if (loop->getNumBlocks() <= tight_loop_max_blocks)
+                BasicBlockUtils::Tag(bb, "zyrox.loop.tight");
+        }
+    }
+
+    if (hot_loops > 0)
+    {
+        Logger::Info("{}: {} hot loops", demangle(f.getName()), hot_loops);
+    }
+}
+
+bool HotnessUtils::IsHot(BasicBlock *bb)
+{
+    return BasicBlockUtils::HasTag(bb, "zyrox.hot");
+}
+
+bool HotnessUtils::IsCold(BasicBlock *bb)
+{
+    return BasicBlockUtils::HasTag(bb, "zyrox.cold");
+}
+
+bool HotnessUtils::IsHotFunction(Function &f)
+{
+    if (f.hasFnAttribute(Attribute::Hot))
+        return true;
+
+    ProfileSummaryInfo *psi = ZyroxAnalysis::GetProfileSummary();
+    return psi && psi->hasProfileSummary() &&
+           psi->isFunctionEntryHot(&f);
+}
+
+bool HotnessUtils::IsColdFunction(Function &f)
+{
+    if (f.hasFnAttribute(Attribute::Cold))
+        return true;
+
+    ProfileSummaryInfo *psi = ZyroxAnalysis::GetProfileSummary();
+    return psi && psi->hasProfileSummary() && psi->isFunctionEntryCold(&f);
+}
+
+void HotnessUtils::MarkCold(Function &f)
+{
+    f.addFnAttr(Attribute::Cold);
+    f.setSectionPrefix("unlikely");
+}
+
+bool HotnessUtils::IsInnerLoop(BasicBlock *bb)
+{
+    return BasicBlockUtils::HasTag(bb, "zyrox.loop.inner");
+}
+
+bool HotnessUtils::IsTightLoop(BasicBlock *bb)
+{
+    return BasicBlockUtils::HasTag(bb, "zyrox.loop.tight");
+}
+
+bool HotnessUtils::IsLoopCarried(Instruction *i)
+{
+    return BasicBlockUtils::HasTag(i, "zyrox.loop.carried");
+}
+
+bool HotnessUtils::IsBackEdge(Instruction *i)
+{
+    return BasicBlockUtils::HasTag(i, "zyrox.loop.backedge");
+}
@@ -1,3 +1,5 @@
+#include <core/ZyroxMetaData.h>
+#include <core/ZyroxModuleOptions.h>
 #include <core/ZyroxPassOptions.h>
 #include <llvm/AsmParser/Parser.h>
 #include <llvm/IR/Constants.h>
@@ -6,9 +8,15 @@
 #include <llvm/Support/SourceMgr.h>
 #include <llvm/Transforms/Utils/Cloning.h>
 #include <llvm/Transforms/Utils/ModuleUtils.h>
+#include <fstream>
+#include <functional>
+#include <map>
 #include <random>
+#include <set>
 #include <sstream>
+#include <utils/BasicBlockUtils.h>
 #include <utils/FunctionUtils.h>
+#include <utils/HotnessUtils.h>
 #include <utils/Logger.h>
 #include <utils/ModuleUtils.h>
 
@@ -67,11 +75,245 @@ void ModuleUtils::ShuffleFunctions(Module &m)
     }
 }
 
+Function *UniqueCaller(Function &f)
+{
+    Function *caller = nullptr;
+    for (User *user : f.users())
+    {
+        auto *call = dyn_cast<CallBase>(user);
+        if (!call || call->getCalledFunction() != &f)
+            return nullptr;
+
+        Function *parent = call->getFunction();
+        if (caller && caller != parent)
+            return nullptr;
+        caller = parent;
+    }
+    return caller == &f ? nullptr : caller;
+}
+
+std::vector<std::vector<Function *>> ModuleUtils::FunctionClusters(Module &m)
+{
+    std::vector<std::vector<Function *>> clusters;
+    std::map<Function *, size_t> cluster_of_root;
+
+    // roots first so every cluster starts with its root
+    std::vector<std::pair<Function *, Function *>> members;
+    for (Function &f : m)
+    {
+        if (f.isDeclaration())
+            continue;
+
+        Function *root = &f;
+        std::set<Function *> seen = {&f};
+        while (Function *caller = UniqueCaller(*root))
+        {
+            if (seen.contains(caller))
+                break;
+            seen.insert(caller);
+            root = caller;
+        }
+
+        if (root == &f)
+        {
+            cluster_of_root[&f] = clusters.size();
+            clusters.push_back({&f});
+        }
+        else
+        {
+            members.push_back({&f, root});
+        }
+    }
+
+    for (auto &[f, root] : members)
+    {
+        if (!cluster_of_root.contains(root))
+        {
+            // caller cycle, the walk ended on a function that isn't a root
+            cluster_of_root[root] = clusters.size();
+            clusters.push_back({});
+        }
+        clusters[cluster_of_root[root]].push_back(f);
+    }
+
+    return clusters;
+}
+
+void CollectUserFunctions(Value *v, std::set<Function *> &functions)
+{
+    for (User *user : v->users())
+    {
+        if (auto *i = dyn_cast<Instruction>(user))
+            functions.insert(i->getFunction());
+        else if (isa<Constant>(user) && !isa<GlobalValue>(user))
+            CollectUserFunctions(user, functions);
+    }
+}
+
+void ModuleUtils::ShuffleClustered(Module &m)
+{
+    std::random_device rd;
+    std::mt19937 rng(rd());
+
+    std::vector<std::vector<Function *>> clusters = FunctionClusters(m);
+
+    std::vector<size_t> hot_clusters;
+    std::vector<size_t> other_clusters;
+    for (size_t i = 0; i < clusters.size(); i++)
+    {
+        std::ranges::shuffle(clusters[i], rng);
+        bool is_hot = std::ranges::any_of(
+            clusters[i], [](Function *f)
+            { return HotnessUtils::IsHotFunction(*f); });
+        (is_hot ? hot_clusters : other_clusters).push_back(i);
+    }
+    std::ranges::shuffle(hot_clusters, rng);
+    std::ranges::shuffle(other_clusters, rng);
+
+    std::vector<size_t> order = hot_clusters;
+    order.insert(order.end(), other_clusters.begin(), other_clusters.end());
+
+    std::map<Function *, size_t> cluster_of;
+    for (size_t i : order)
+    {
+        for (Function *f : clusters[i])
+        {
+            cluster_of[f] = i;
+            m.getFunctionList().remove(f);
+            m.getFunctionList().push_back(f);
+        }
+    }
+
+    // globals used from a single cluster (per state globals, key arrays,
+    // encrypted strings) go with it, the rest is shuffled at the end.
+    std::vector<std::vector<GlobalVariable *>> global_clusters(clusters.size());
+    std::vector<GlobalVariable *> shared_globals;
+    for (GlobalVariable &gv : m.globals())
+    {
+        std::set<Function *> users;
+        CollectUserFunctions(&gv, users);
+
+        std::set<size_t> user_clusters;
+        for (Function *f : users)
+        {
+            if (cluster_of.contains(f))
+                user_clusters.insert(cluster_of[f]);
+        }
+
+        if (user_clusters.size() == 1)
+            global_clusters[*user_clusters.begin()].push_back(&gv);
+        else
+            shared_globals.push_back(&gv);
+    }
+
+    std::ranges::shuffle(shared_globals, rng);
+
+    std::vector<GlobalVariable *> globals;
+    for (size_t i : order)
+    {
+        std::ranges::shuffle(global_clusters[i], rng);
+        globals.insert(globals.end(), global_clusters[i].begin(),
+                       global_clusters[i].end());
+    }
+    globals.insert(globals.end(), shared_globals.begin(), shared_globals.end());
+
+    for (auto *gv : globals)
+    {
+        gv->removeFromParent();
+    }
+
+    for (auto *gv : globals)
+    {
+        m.insertGlobalVariable(gv);
+    }
+}
+
+void ModuleUtils::WriteSymbolOrder(Module &m, const char *path)
+{
+    struct ClusterOrder
+    {
+        std::vector<Function *> functions;
+        bool is_hot;
+        uint64_t entry_count;
+    };
+
+    std::vector<ClusterOrder> ordered;
+    for (std::vector<Function *> &cluster : FunctionClusters(m))
+    {
+        auto is_obfuscated = [](Function *f)
+        { return ZyroxPassesMetadata::IsObfuscated(*f); };
+        if (std::ranges::none_of(cluster, is_obfuscated))
+            continue;
+
+        ClusterOrder order = {cluster, false, 0};
+        for (Function *f : cluster)
+        {
+            order.is_hot |= HotnessUtils::IsHotFunction(*f);
+            if (auto count = f->getEntryCount())
+                order.entry_count =
+                    std::max(order.entry_count, count->getCount());
+        }
+        ordered.push_back(order);
+    }
+
+    if (ordered.empty())
+        return;
+
+    std::ranges::stable_sort(ordered,
+                             [](const ClusterOrder &a, const ClusterOrder &b)
+                             {
+                                 if (a.is_hot != b.is_hot)
+                                     return a.is_hot;
+                                 return a.entry_count > b.entry_count;
+                             });
+
+    std::ofstream outfile(path);
+    if (!outfile.is_open())
+    {
+        Logger::Warn("Error opening output file {}", path);
+        return;
+    }
+
+    for (ClusterOrder &order : ordered)
+    {
+        for (Function *f : order.functions)
+        {
+            // private functions have no symbol to order
+            if (!f->hasPrivateLinkage())
+                outfile << f->getName().str() << "\n";
+        }
+    }
+
+    outfile.close();
+}
+
 std::vector<std::string> Split(const std::string &s, char delim);
 
 void AddPotentialPass(Function &f, StringRef &annotation);
 
+void ForEachAnnotation(Module &m,
+                       const std::function<void(Function &, StringRef)> &fn);
+
 void ModuleUtils::ExpandCustomAnnotations(Module &m)
+{
+    ForEachAnnotation(m, [](Function &f, StringRef annotation)
+                      { AddPotentialPass(f, annotation); });
+}
+
+void ModuleUtils::PinPlannedFunctions(Module &m)
+{
+    for (Function &f : m)
+    {
+        if (f.isDeclaration() || !f.hasMetadata("zyrox"))
+            continue;
+        f.removeFnAttr(Attribute::AlwaysInline);
+        f.addFnAttr(Attribute::NoInline);
+        f.setMetadata("zyrox", nullptr);
+    }
+}
+
+void ForEachAnnotation(Module &m,
+                       const std::function<void(Function &, StringRef)> &fn)
 {
     if (GlobalVariable *global_annotations =
             m.getNamedGlobal("llvm.global.annotations"))
@@ -93,13 +335,31 @@ void ModuleUtils::ExpandCustomAnnotations(Module &m)
                     StringRef annotation = cast<ConstantDataArray>(
                                                annotation_str->getInitializer())
                                                ->getAsCString();
-                    AddPotentialPass(*f, annotation);
+                    fn(*f, annotation);
                 }
             }
         }
     }
 }
 
+void ModuleUtils::ExpandRegionMarkers(Module &m)
+{
+    for (Function &f : m)
+    {
+        if (!f.isDeclaration() && FunctionUtils::MarkRegions(f))
+        {
+            Logger::Info("found obfuscation regions in {}",
+                         demangle(f.getName()));
+        }
+    }
+
+    for (const char *marker : {"__zyrox_region_begin", "__zyrox_region_end"})
+    {
+        if (Function *f = m.getFunction(marker); f && f->use_empty())
+            f->eraseFromParent();
+    }
+}
+
 std::unique_ptr<Module> ModuleUtils::LoadFromIR(LLVMContext &ctx,
                                                 const char *ir)
 {
@@ -140,8 +400,20 @@ void AddMetaDatas(Module &m);
 void ModuleUtils::Finalize(Module &m)
 {
     AddMetaDatas(m);
-    ShuffleFunctions(m);
-    ShuffleGlobals(m);
+    for (Function &f : m)
+    {
+        BasicBlockUtils::StripTags(f);
+    }
+
+    if (ZyroxModuleOptions::Get("SymbolLayout.Mode") == 1)
+    {
+        ShuffleClustered(m);
+    }
+    else
+    {
+        ShuffleFunctions(m);
+        ShuffleGlobals(m);
+    }
 }
 
 void AddPotentialPass(Function &f, StringRef &annotation)
@@ -0,0 +1,92 @@
+#include <map>
+#include <set>
+#include <utils/BasicBlockUtils.h>
+#include <utils/ScratchSlots.h>
+#include <vector>
+
+struct ScopedSlot
+{
+    AllocaInst *slot;
+    bool in_use;
+};
+
+// only the in_use flags are kept between calls, the slots themselves are
+// found again in the entry block. passes scheduled in between (sroa, mem2reg)
+// may have deleted them
+std::map<Function *, std::vector<ScopedSlot>> scoped_slots;
+
+AllocaInst *CreateEntrySlot(Function &f, Type *ty, StringRef name,
+                            const std::string &tag)
+{
+    IRBuilder<> builder(&*f.getEntryBlock().getFirstInsertionPt());
+    AllocaInst *slot = builder.CreateAlloca(ty, nullptr, name);
+    BasicBlockUtils::Tag(slot, tag);
+    return slot;
+}
+
+AllocaInst *ScratchSlots::Shared(Function &f, Type *ty, StringRef name)
+{
+    // value names are discarded, the name lives in the tag
+    std::string tag = "zyrox.slot." + name.str();
+    for (Instruction &i : f.getEntryBlock())
+    {
+        auto *slot = dyn_cast<AllocaInst>(&i);
+        if (slot && slot->getAllocatedType() == ty &&
+            BasicBlockUtils::HasTag(slot, tag))
+            return slot;
+    }
+
+    return CreateEntrySlot(f, ty, name, tag);
+}
+
+AllocaInst *ScratchSlots::Acquire(IRBuilderBase &builder, Type *ty,
+                                  StringRef name)
+{
+    Function &f = *builder.GetInsertBlock()->getParent();
+    std::vector<ScopedSlot> &slots = scoped_slots[&f];
+
+    // drop slots that are gone (or belong to a dead function at the same
+    // address) before touching any of them, only pointers are compared
+    std::set<AllocaInst *> live;
+    for (Instruction &i : f.getEntryBlock())
+    {
+        auto *slot = dyn_cast<AllocaInst>(&i);
+        if (slot && BasicBlockUtils::HasTag(slot, "zyrox.scoped"))
+            live.insert(slot);
+    }
+    std::erase_if(slots, [&](ScopedSlot &scoped)
+                  { return !live.count(scoped.slot); });
+
+    AllocaInst *slot = nullptr;
+    for (ScopedSlot &scoped : slots)
+    {
+        if (!scoped.in_use && scoped.slot->getAllocatedType() == ty)
+        {
+            scoped.in_use = true;
+            slot = scoped.slot;
+            break;
+        }
+    }
+
+    if (!slot)
+    {
+        slot = CreateEntrySlot(f, ty, name, "zyrox.scoped");
+        slots.push_back({.slot = slot, .in_use = true});
+    }
+
+    builder.CreateLifetimeStart(slot);
+    return slot;
+}
+
+void ScratchSlots::Release(IRBuilderBase &builder, AllocaInst *slot)
+{
+    builder.CreateLifetimeEnd(slot);
+
+    for (ScopedSlot &scoped : scoped_slots[slot->getFunction()])
+    {
+        if (scoped.slot == slot)
+            scoped.in_use = false;
+    }
+}
+
+void ScratchSlots::Reset() { scoped_slots.clear(); }
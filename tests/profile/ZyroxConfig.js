@@ -0,0 +1,14 @@
+/**
+ * @implements {ZyroxPlugin}
+ */
+class ZyroxPluginImpl {
+    OnString(Str) {
+        return z.Stack;
+    }
+
+    Init() {
+        z.SetOption("Profile.File", "out/default.profdata");
+    }
+}
+
+z.RegisterClass(new ZyroxPluginImpl());
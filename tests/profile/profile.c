@@ -0,0 +1,17 @@
+#include <stdio.h>
+
+// Greet uses an encrypted string, zyrox-prepare adds its decryption loop
+// to the function. the profile has to be matched before that, or the cfg
+// hash differs and Greet silently loses its counts.
+__attribute__((noinline)) void Greet(int i)
+{
+    if (i % 3 == 0)
+        printf("hello from the hot path %d\n", i);
+}
+
+int main()
+{
+    for (int i = 0; i < 100000; i++)
+        Greet(i);
+    return 0;
+}
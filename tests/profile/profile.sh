@@ -0,0 +1,20 @@
+#!/bin/bash
+set -e
+
+# string encryption and Profile.File together, the encrypted function must
+# keep its profile counts, see profile.c
+mkdir -p out
+clang -O0 -fprofile-generate=out/raw profile.c -o out/profile_gen
+./out/profile_gen > /dev/null
+llvm-profdata merge out/raw -o out/default.profdata
+
+clang -O0 -Xclang -disable-O0-optnone -S -emit-llvm profile.c -o out/profile.ll
+opt -load-pass-plugin=../../build/libzyrox.so -passes='zyrox-prepare' \
+    out/profile.ll -S -o out/prepared.ll
+
+if grep -E '^define .*@Greet\(.*!prof ' out/prepared.ll > /dev/null; then
+    echo "profile: ok"
+else
+    echo "profile: FAILED, Greet lost its profile"
+    exit 1
+fi
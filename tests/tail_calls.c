@@ -0,0 +1,69 @@
+#include <stdio.h>
+
+// far deeper than any default stack, every call below has to stay a tail
+// call (a jmp) after obfuscation or the program crashes.
+#define DEPTH 50000000L
+
+__attribute__((noinline, annotate("bbs:1,2,3,100 cff:1 sibr:1,100"))) long
+IsOdd(long n);
+
+__attribute__((noinline, annotate("bbs:1,2,3,100 cff:1 sibr:1,100"))) long
+IsEven(long n)
+{
+    if (n == 0)
+        return 1;
+    return IsOdd(n - 1);
+}
+
+long IsOdd(long n)
+{
+    if (n == 0)
+        return 0;
+    return IsEven(n - 1);
+}
+
+__attribute__((noinline, annotate("bbs:1,2,3,100 cff:1 ibr:1,100"))) long
+Pong(long n, long acc);
+
+__attribute__((noinline, annotate("bbs:1,2,3,100 cff:1 ibr:1,100"))) long
+Ping(long n, long acc)
+{
+    if (n == 0)
+        return acc;
+    __attribute__((musttail)) return Pong(n - 1, acc + 2);
+}
+
+long Pong(long n, long acc)
+{
+    if (n == 0)
+        return acc;
+    __attribute__((musttail)) return Ping(n - 1, acc - 1);
+}
+
+static long ticks;
+
+__attribute__((noinline)) long Tick(long n)
+{
+    ticks += n;
+    return ticks;
+}
+
+// a void function tail calling a non-void one, the call is followed by
+// `ret void` and must not become a ret of its result
+__attribute__((noinline, annotate("bbs:1,2,3,100 cff:1 sibr:1,100"))) void
+Tock(long n)
+{
+    if (n == 0)
+        return;
+    Tick(n);
+}
+
+int main()
+{
+    printf("IsEven: %ld\n", IsEven(DEPTH));
+    printf("Ping: %ld\n", Ping(DEPTH, 0));
+    for (long i = 0; i < 10; i++)
+        Tock(i);
+    printf("Ticks: %ld\n", ticks);
+    return 0;
+}
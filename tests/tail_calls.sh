@@ -0,0 +1,15 @@
+#!/bin/bash
+set -e
+
+# tail calls (plain and musttail) must survive every pass, see tail_calls.c
+mkdir -p out
+clang -O2 -flto=full -c tail_calls.c -o out/tail_calls.o
+clang -O2 -flto=full -fuse-ld=lld -Wl,--load-pass-plugin=../build/libzyrox.so out/tail_calls.o -o out/tail_calls
+
+echo "running tail calls..."
+if ./out/tail_calls; then
+    echo "tail calls: ok"
+else
+    echo "tail calls: FAILED, a tail call was lost"
+    exit 1
+fi